@@ -38,11 +38,77 @@
 #define PM_UPTODATE     (1<<19) /* Parameter has up-to-date data (e.g. loaded from DB) */
 #endif
 
+struct gsu_scalar_ext;
+
 static Param createhash( char *name, int flags );
 static int append_tied_name( const char *name );
 static int remove_tied_name( const char *name );
 static char *unmetafy_zalloc(const char *to_copy, int *new_len);
 static void set_length(char *buf, int size);
+static Heap arena_enter(struct gsu_scalar_ext *gsu_ext);
+static void arena_leave(struct gsu_scalar_ext *gsu_ext, Heap oldheaps);
+static void arena_release(struct gsu_scalar_ext *gsu_ext);
+static int arena_class(size_t len);
+static char *arena_strdup(struct gsu_scalar_ext *gsu_ext, const char *s);
+static void arena_drop(struct gsu_scalar_ext *gsu_ext, char *buf);
+static void setcachedvalue(Param pm, const char *val);
+static void freegdbmnode(HashNode hn);
+static void emptygdbmtable(HashTable ht);
+static zulong keyhash(const char *key, int len);
+static int bloom_test(struct gsu_scalar_ext *gsu_ext, const char *key, int len);
+static void bloom_add(struct gsu_scalar_ext *gsu_ext, const char *key, int len);
+static int bloom_build(struct gsu_scalar_ext *gsu_ext);
+static int bloom_load(struct gsu_scalar_ext *gsu_ext);
+static int bloom_save(struct gsu_scalar_ext *gsu_ext);
+static void bloom_free(struct gsu_scalar_ext *gsu_ext);
+struct tieopts;
+struct zgdbm_snap;
+static struct zgdbm_snap *snap_open(const char *path);
+static void snap_close(struct zgdbm_snap *snap);
+static char *snap_lookup(struct zgdbm_snap *snap, const char *key);
+static int parse_tieopts(char *nam, char *str, struct tieopts *opts);
+static void zgdbm_preprompt(void);
+static void zgdbm_idletimer(void);
+static void tie_idleclose(int prompt);
+
+/* Time of the scheduled zgdbm_idletimer(), 0 if none */
+static time_t idle_when;
+
+/*
+ * Trace of operations (zgdbmtrace on), a ring of
+ * `trace_size` entries, `trace_count` were added in
+ * total. With it off, an operation only tests the
+ * ring pointer.
+ */
+struct trace_ent;
+static struct trace_ent *trace_ring;
+static zulong trace_size, trace_count;
+static zlong trace_now(void);
+static void trace_add(int op, zlong start, zulong hash, zulong size);
+static void trace_name(int op, zlong start, const char *name, zulong size);
+static void trace_stop(void);
+
+/* Start time of a traced operation, 0 with tracing off */
+#define TRACE_START()   (trace_ring ? trace_now() : 0)
+
+static int zgdbm_exithook(Hookdef d, void *dummy);
+static int watch_start(struct gsu_scalar_ext *gsu_ext, const char *path, int reopen);
+static int watch_changed(struct gsu_scalar_ext *gsu_ext);
+static void watch_stop(struct gsu_scalar_ext *gsu_ext);
+static void watch_mark(struct gsu_scalar_ext *gsu_ext);
+static int st_changed(const struct stat *st, const struct stat *old);
+static void tie_refresh(HashTable ht);
+static int chlog_open(struct gsu_scalar_ext *gsu_ext);
+static void chlog_close(struct gsu_scalar_ext *gsu_ext);
+static void chlog_note(struct gsu_scalar_ext *gsu_ext, const char *name);
+static void chlog_apply(HashTable ht);
+static int tie_ensure(struct gsu_scalar_ext *gsu_ext);
+static void tie_close(struct gsu_scalar_ext *gsu_ext);
+static int tie_reopen(struct gsu_scalar_ext *gsu_ext);
+struct zgdbm_sweep;
+struct zgdbm_warm;
+struct zgdbm_dedup;
+struct zgdbm_arr;
 
 /*
  * Make sure we have all the bits I'm using for memory mapping, otherwise
@@ -52,45 +118,912 @@ static void set_length(char *buf, int size);
 
 #include <gdbm.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define ZGDBM_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#define ZGDBM_WRITEBEHIND
+#include <pthread.h>
+#endif
+
+static int snap_write(struct gsu_scalar_ext *gsu_ext, const char *path);
+static void rec_encode(struct gsu_scalar_ext *gsu_ext, datum in, int flags, zlong expire,
+                       datum *out);
+static int rec_decode(struct gsu_scalar_ext *gsu_ext, datum in, datum *out, int *flags);
+static zlong rec_expiry(datum in);
+static int tie_get(struct gsu_scalar_ext *gsu_ext, datum key, datum *content);
+static int tie_fetch(struct gsu_scalar_ext *gsu_ext, datum key, datum *content);
+static int tie_store(struct gsu_scalar_ext *gsu_ext, datum key, datum content, int replace);
+static int tie_delete(struct gsu_scalar_ext *gsu_ext, datum key);
+static int tie_keyok(datum key);
+static char *dedup_intern(struct gsu_scalar_ext *gsu_ext, const char *val);
+static int dedup_interned(struct zgdbm_dedup *dedup, const char *str);
+static void dedup_forget(struct zgdbm_dedup *dedup);
+static void tie_sweep(struct gsu_scalar_ext *gsu_ext);
+static char *tie_load(struct gsu_scalar_ext *gsu_ext, char *name, datum key, zlong *expires);
+static void warm_note(struct zgdbm_warm *warm, const char *name);
+static void warm_load(struct gsu_scalar_ext *gsu_ext);
+static void warm_save(struct gsu_scalar_ext *gsu_ext);
+static void rec_array_pack(char **elems, datum *out);
+static int rec_array_next(datum payload, int *off, datum *elem);
+static void rec_text(datum *content, int flags);
+static int tie_hold(struct gsu_scalar_ext *gsu_ext, int hold);
+static zlong arr_length(struct gsu_scalar_ext *gsu_ext);
+static int arr_setlength(struct gsu_scalar_ext *gsu_ext, zlong len);
+static char *arr_get(struct gsu_scalar_ext *gsu_ext, zlong i);
+static int arr_put(struct gsu_scalar_ext *gsu_ext, zlong i, char *val);
+static void arr_drop(struct zgdbm_arr *arr);
+static int arr_logged(struct zgdbm_arr *arr);
+static void arr_untie(Param pm);
+static struct gsu_scalar_ext *tied_ext(Param pm);
+
 static char *backtype = "db/gdbm";
 
 /*
- * Longer GSU structure, to carry GDBM_FILE of owning
- * database. Every parameter (hash value) receives GSU
- * pointer and thus also receives GDBM_FILE - this way
- * parameters can access proper database.
+ * Storage engine of a tie, chosen with ztie -d from
+ * `backends`. Keys and values passed to and from it are
+ * unmetafied. Fetched value and keys from firstkey() and
+ * nextkey() are owned by the engine, they are valid
+ * until its next call of the same kind.
+ *
+ * fetch(), firstkey() and nextkey() return 0 on success.
+ * nextkey() returns the key after `key`, the one it or
+ * firstkey() returned last - of an engine that stores,
+ * `key` can also be any key of the database, iteration
+ * then continues after it.
+ * store() returns 0 when stored, 1 when the key exists
+ * and `replace` isn't set, -1 on error. delete() returns
+ * 0 when deleted, 1 when there was no such key, -1 on
+ * error.
+ * wipe() deletes all keys.
+ *
+ * `opts` has bit of each ztie -o setting that is used.
+ * idle(), if set, is called before each prompt, for
+ * work that can wait until the shell is idle.
+ */
+
+struct zgdbm_backend {
+    const char *name;
+    int opts;
+    void *(*open)(char *nam, char *path, int readonly, struct tieopts *opts);
+    void (*close)(void *db);
+    int (*fetch)(void *db, datum key, datum *content);
+    int (*store)(void *db, datum key, datum content, int replace);
+    int (*delete)(void *db, datum key);
+    int (*firstkey)(void *db, datum *key);
+    int (*nextkey)(void *db, datum *key);
+    zulong (*count)(void *db);
+    int (*sync)(void *db);
+    int (*fd)(void *db);
+    int (*wipe)(void *db);
+    int (*info)(void *db, char **info, int n);
+    void (*idle)(void *db);
+    void (*reload)(void *db);
+};
+
+static void *tie_open(char *nam, const struct zgdbm_backend *backend, char *path,
+                      int readonly, struct tieopts *opts, double timeout, zlong *waited);
+static long tie_jitter(long max);
+static int arr_tie(char *nam, char *pmname, int pmflags, const struct zgdbm_backend *engine,
+                   void *db, struct tieopts *opts, char *path, zlong waited);
+
+/* Buffers of the arena are of 2^ARENA_MINCLASS bytes or
+ * more, a power of 2, longer ones aren't reused */
+#define ARENA_MINCLASS  4
+#define ARENA_CLASSES   28
+
+/*
+ * Longer GSU structure, to carry the database handle of
+ * owning database. Every parameter (hash value) receives
+ * GSU pointer and thus also receives the handle - this
+ * way parameters can access proper database.
  *
  * Main HashTable parameter has the same instance of
  * the custom GSU struct in u.hash->tmpdata field.
- * When database is closed, `dbf` field is set to NULL
+ * When database is closed, `db` field is set to NULL
  * and hash values know to not access database when
  * being unset (total purge at zuntie).
  *
  * When database closing is ended, custom GSU struct
  * is freed. Only new ztie creates new custom GSU
  * struct instance.
+ *
+ * The struct also owns the tie's arena - a private list
+ * of zsh heaps (see mem.c) holding the interfacing Params,
+ * their names and cached values. Nothing in it is freed
+ * one by one, the whole arena is released chunk by chunk
+ * when the hash is deleted, so zuntie cost doesn't depend
+ * on number of keys seen. `arena` is the list zhalloc()
+ * extends, kept at a single chunk so that allocation
+ * doesn't rescan full chunks, which are moved to
+ * `arena_full`.
+ *
+ * `bloom` is the optional filter of keys present in the
+ * database (ztie -b), see bloom_test().
+ *
+ * `tuned` has bit set for each setting chosen with `auto`.
+ *
+ * `snap` is set instead of `db` for ties of a snapshot
+ * (ztie -s), the database itself isn't opened then.
+ *
+ * `opts` are the ztie -o settings, for opening the
+ * database again. `watch` is set for ztie -w.
+ *
+ * `chlog` of a writable tie lists keys written by forked
+ * subshells, see chlog_note().
+ *
+ * `waited` is how long ztie -t waited for the lock, in
+ * milliseconds.
+ *
+ * `lazy` is set for ztie -o idle=N, then `db` is NULL
+ * also while the tie is closed between uses.
+ *
+ * `ht` is the tied hash, for dropping all cached values
+ * found stale at access to one of them.
+ *
+ * `zcount` values were stored compressed (-o compress=N),
+ * `zraw` bytes of them taking `zstored` bytes.
+ *
+ * `sweep` is set when values of the tie can expire
+ * (-o ttl=N, zgdbmexpire).
+ *
+ * `loader` is name of the function making missing values
+ * (ztie -l), `loading` is set while it runs.
+ *
+ * `warm` counts uses of keys, for ztie -o warm=N.
+ *
+ * `dedup` is set for ztie -o dedup=N, long values are
+ * then stored once and cached once.
+ *
+ * `freenodes` lists elements removed from the hash, in
+ * the arena, for getgdbmnode() to reuse.
+ *
+ * `freebufs` lists abandoned value and name buffers per
+ * size class, for arena_strdup() to reuse, `freebytes`
+ * is their total size.
  */
 
 struct gsu_scalar_ext {
     struct gsu_scalar std;
-    GDBM_FILE dbf;
+    const struct zgdbm_backend *backend;
+    void *db;
     char *dbfile_path;
+    Heap arena;
+    Heap arena_full;
+    struct zgdbm_bloom *bloom;
+    int tuned;
+    struct zgdbm_snap *snap;
+    struct tieopts *opts;
+    struct zgdbm_watch *watch;
+    struct zgdbm_chlog *chlog;
+    zlong waited;
+    struct zgdbm_lazy *lazy;
+    HashTable ht;
+    zulong zcount;
+    zulong zraw;
+    zulong zstored;
+    struct zgdbm_sweep *sweep;
+    char *loader;
+    int loading;
+    struct zgdbm_warm *warm;
+    struct zgdbm_dedup *dedup;
+    HashNode freenodes;
+    char *freebufs[ARENA_CLASSES];
+    zulong freebytes;
+};
+
+/*
+ * Element of a tied hash, made by getgdbmnode(). The
+ * cached value of a record that expires is up to date
+ * until `expires`, 0 when the record doesn't expire.
+ */
+
+struct gdbm_elem {
+    struct param pm;
+    zlong expires;
+};
+
+#define ELEM_EXPIRES(pm) (((struct gdbm_elem *) (pm))->expires)
+
+/* Whether cached values are checked at every access */
+#define TIE_CHECKED(gsu_ext) ((gsu_ext)->lazy || (gsu_ext)->opts->val[TOPT_SHARED])
+
+struct zgdbm_watch {
+    char *path;             /* unmetafied */
+    struct stat st;         /* of the file when last seen or written */
+    int reopen;             /* of a read-only tie, the file can be replaced */
+};
+
+#define CHLOG_SIZE  ((size_t) 1 << 16)
+
+/* Start of the change log, null-terminated keys follow */
+struct chlog_header {
+    volatile zulong seq;    /* changes logged, in total */
+    zulong used;            /* bytes of keys */
+    int all;                /* log was full, or all keys changed */
+};
+
+struct zgdbm_chlog {
+    int fd;
+    pid_t pid;              /* of the shell that tied */
+    zulong seen;            /* `seq` when last consumed */
+    struct chlog_header *hdr;
+};
+
+static int chlog_lock(struct zgdbm_chlog *chlog, int type);
+
+/*
+ * Lazy tie (ztie -o idle=N): the database is opened at
+ * first access, and closed when unused for N seconds -
+ * with 0 before each prompt - so that the lock is held
+ * only while the tie is in use. Cached values are kept
+ * over the close when the file is found unchanged at
+ * the next open.
+ */
+struct zgdbm_lazy {
+    int readonly;
+    double timeout;         /* wait for the lock at open */
+    time_t used;            /* last access, while open */
+    zlong opens;            /* reopens done */
+    struct stat st;         /* of the file at close */
+};
+
+/*
+ * Expiring values (ztie -o ttl=N, zgdbmexpire). A value
+ * past its expiry reads as absent, before each prompt a
+ * slice of the keys is checked and the expired ones are
+ * deleted, the next slice starts at `key`.
+ */
+struct zgdbm_sweep {
+    char *key;              /* unmetafied, NULL at start of the keys */
+    int klen;
+    zlong expired;          /* keys deleted */
+};
+
+/* Keys checked by one sweep */
+#define TIE_SWEEPSLICE  64
+
+/*
+ * Traced operation. `hash` is keyhash() of the key,
+ * of the path for open, untie and lock; `size` is
+ * bytes of the value, keys of a scan or assignment
+ * of the whole hash.
+ */
+struct trace_ent {
+    zlong start;            /* microseconds since the epoch */
+    zlong dur;              /* microseconds */
+    zulong hash;
+    zulong size;
+    int op;
+};
+
+enum {
+    TRACE_GET,
+    TRACE_SET,
+    TRACE_UNSET,
+    TRACE_SCAN,
+    TRACE_HASHSET,
+    TRACE_OPEN,
+    TRACE_UNTIE,
+    TRACE_LOCK
+};
+
+static const char *trace_ops[] = {
+    "get", "set", "unset", "scan", "hashset", "open", "untie", "lock"
+};
+
+/* Entries of the ring without zgdbmtrace on N */
+#define TRACE_SIZE      4096
+
+/* Header of binary dump (zgdbmtrace -b dump), entries follow */
+#define TRACE_MAGIC     "ZGTRACE1"
+
+struct trace_header {
+    char magic[8];
+    zulong nents;
+    zulong entsize;         /* sizeof(struct trace_ent) */
+};
+
+/*
+ * Loader function (ztie -l). While one shell runs it for
+ * a key, a lock record is stored under the key prefixed
+ * with LOAD_MAGIC, other shells sharing the database wait
+ * for the value instead of making it too. The lock of a
+ * shell that exited, or one older than TIE_LOADWAIT
+ * seconds, is taken over.
+ */
+struct load_lock {
+    pid_t pid;
+    zlong started;
+};
+
+#define LOAD_MAGIC      "\0zgL"
+#define LOAD_MAGICLEN   4
+#define LOAD_ISLOCK(key) \
+    ((key).dsize >= LOAD_MAGICLEN && !memcmp((key).dptr, LOAD_MAGIC, LOAD_MAGICLEN))
+#define TIE_LOADWAIT    60
+
+/*
+ * Shared values (ztie -o dedup=N). A value of at least N
+ * bytes is stored once, under DEDUP_MAGIC and keyhash()
+ * of the record, preceded by count of the keys referring
+ * to it (zulong); a key holds a REC_REF record with the
+ * hash. Values whose hash is taken by another value are
+ * stored as they are. Cached values that long are
+ * interned: `strs` is an open-addressing table of them,
+ * in the arena, shared by all elements having the value.
+ */
+struct zgdbm_dedup {
+    zlong min;
+    char **strs;
+    zulong size;            /* power of 2, 0 at start */
+    zulong count;
+    zlong shared;           /* stores that found the value stored */
+};
+
+#define DEDUP_MAGIC     "\0zgV"
+#define DEDUP_MAGICLEN  4
+#define DEDUP_KEYLEN    (DEDUP_MAGICLEN + sizeof(zulong))
+#define DEDUP_ISVALUE(key) \
+    ((key).dsize == DEDUP_KEYLEN && !memcmp((key).dptr, DEDUP_MAGIC, DEDUP_MAGICLEN))
+
+/*
+ * Tied array (ztie -a). Element i, from 1, is stored under
+ * i as a big-endian number without leading zero bytes, the
+ * length under ARR_LENKEY as zlong. zsh asks for the whole
+ * array even for $arr[i], so at first use all elements are
+ * read, in one pass, and cached; later uses cost nothing.
+ * The cache is dropped after a subshell wrote the array,
+ * as told by the change log, and with -o shared when the
+ * stored length differs. Assignment writes only the
+ * elements that changed.
+ */
+struct zgdbm_arr {
+    struct gsu_array std;
+    struct gsu_scalar_ext *tie;
+    zlong len;              /* of `elems` */
+    char **elems;           /* NULL until read */
+};
+
+#define ARR_LENKEY      "\0zgN"
+#define ARR_LENKEYLEN   4
+#define ARR_ISLEN(key) \
+    ((key).dsize == ARR_LENKEYLEN && !memcmp((key).dptr, ARR_LENKEY, ARR_LENKEYLEN))
+
+/* Keys the module stores for itself, not elements of the
+ * hash; the tie refuses to write them, see tie_keyok() */
+#define TIE_RESERVED(key) (LOAD_ISLOCK(key) || DEDUP_ISVALUE(key) || ARR_ISLEN(key))
+
+/* Whether parameter is an array tied with ztie -a */
+#define TIED_ARRAY(pm) \
+    (PM_TYPE((pm)->node.flags) == PM_ARRAY && (pm)->gsu.a->getfn == gdbmarrgetfn)
+
+/*
+ * Warm-up (ztie -o warm=N). Uses of keys are counted in
+ * a count-min sketch. At untie, the N keys of the hash
+ * used most are written to a sidecar file (path with
+ * ".warm" appended), at the next ztie their values are
+ * fetched into the hash before the first use.
+ */
+#define WARM_MAGIC      "ZGWARM01"
+#define WARM_ROWS       4
+#define WARM_WIDTH      1024    /* power of 2 */
+#define WARM_MAXCOUNT   65535
+
+struct zgdbm_warm {
+    unsigned short counts[WARM_ROWS][WARM_WIDTH];
+    zlong loaded;           /* keys fetched at ztie */
 };
 
 /* Source structure - will be copied to allocated one,
- * with `dbf` filled. `dbf` allocation <-> gsu allocation. */
+ * with `db` filled. `db` allocation <-> gsu allocation. */
 static const struct gsu_scalar_ext gdbm_gsu_ext =
-{ { gdbmgetfn, gdbmsetfn, gdbmunsetfn }, 0, 0 };
+{ { gdbmgetfn, gdbmsetfn, gdbmunsetfn }, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+/*
+ * Bloom filter of the keys stored in the database. It is
+ * kept in a sidecar file next to the database (path with
+ * ".bloom" appended) together with size and modification
+ * time of the database it describes - a filter written
+ * for other contents of the database is not used, it is
+ * rebuilt with a scan of the keys.
+ *
+ * A lookup of a key the filter doesn't contain returns
+ * without asking GDBM. Deleted keys stay in the filter,
+ * they only cost a false positive.
+ */
+
+#define BLOOM_MAGIC         "ZGBLOOM1"
+#define BLOOM_BITS_PER_KEY  10      /* ~1% false positives */
+#define BLOOM_HASHES        7
+#define BLOOM_MIN_BITS      ((zulong) 1 << 13)
+
+struct zgdbm_bloom {
+    zulong nbits;           /* size of bit array, power of 2 */
+    zulong nkeys;           /* keys added, with repetitions */
+    int dirty;              /* differs from the sidecar file */
+    unsigned char *bits;
+};
+
+/* Sidecar file header, followed by nbits/8 bytes of bits */
+struct bloom_header {
+    char magic[8];
+    zulong nbits;
+    zulong nkeys;
+    zulong dbsize;
+    zulong dbmtime;
+    zulong dbmtime_ns;
+};
+
+/*
+ * Settings given with `ztie -o name=value,...'. Value
+ * can be `auto', then it is chosen from size of the
+ * database file by tune_gdbm(). Sole `auto' means all
+ * of the settings that can be tuned this way.
+ */
+
+enum {
+    TOPT_BLOCKSIZE,
+    TOPT_CACHE,
+    TOPT_MMAP,
+    TOPT_MAXMAP,
+    TOPT_CENTFREE,
+    TOPT_COALESCE,
+    TOPT_SYNC,
+    TOPT_WRITEBEHIND,
+    TOPT_IDLE,
+    TOPT_SHARED,
+    TOPT_COMPRESS,
+    TOPT_COMPRESSMIN,
+    TOPT_TTL,
+    TOPT_WARM,
+    TOPT_DEDUP,
+    TOPT_COUNT
+};
+
+static const char *tieopt_names[TOPT_COUNT] = {
+    "blocksize", "cache", "mmap", "maxmap", "centfree", "coalesce", "sync",
+    "writebehind", "idle", "shared", "compress", "compressmin",
+    "ttl", "warm", "dedup"
+};
+
+#define TOPT_BIT(opt)   (1 << (opt))
+#define TOPT_AUTOMASK   (TOPT_BIT(TOPT_BLOCKSIZE) | TOPT_BIT(TOPT_CACHE) | \
+                         TOPT_BIT(TOPT_MMAP) | TOPT_BIT(TOPT_MAXMAP))
+/* Handled by ztie itself, for every backend */
+#define TOPT_TIEMASK    (TOPT_BIT(TOPT_IDLE) | TOPT_BIT(TOPT_COMPRESS) | \
+                         TOPT_BIT(TOPT_COMPRESSMIN) | TOPT_BIT(TOPT_TTL) | \
+                         TOPT_BIT(TOPT_WARM) | TOPT_BIT(TOPT_DEDUP))
+
+struct tieopts {
+    zlong val[TOPT_COUNT];
+    int set;                /* bit for each setting given a value */
+    int autoset;            /* bit for each setting to be tuned */
+    int retry;              /* ztie -t: lock held by other process isn't
+                             * reported, open fails with EWOULDBLOCK */
+};
+
+/* Longest sleep between tries of ztie -t, microseconds */
+#define TIE_MAXBACKOFF  (256 * 1000L)
+
+/* Wait for the lock at reopen of a lazy tie without -t, seconds */
+#define TIE_LAZYWAIT    5.0
+
+/*
+ * Record header. A value can be stored with a header that
+ * tells how the rest of the record is encoded; values
+ * without it are stored as given, so records written
+ * before, or by other programs, are read as they were.
+ * A value that itself starts with the magic is stored
+ * with a header, without flags.
+ * The header is the magic and a byte of flags, then come
+ * fields the flags ask for, in order of the flags, then
+ * the value.
+ */
+
+#define REC_MAGIC       "\0zgR"
+#define REC_MAGICLEN    4
+#define REC_HDRLEN      (REC_MAGICLEN + 1)
+
+/* zlib stream of the value, preceded by its size (unsigned int) */
+#define REC_DEFLATE     0x01
+/* Value is an array, elements as size (unsigned int) and bytes */
+#define REC_ARRAY       0x02
+/* Value is a zlong, as in memory (zgdbmincr -b) */
+#define REC_INT         0x04
+/* Value expires, at time given as zlong (seconds since the epoch) */
+#define REC_EXPIRE      0x08
+/* Reference to a shared value, keyhash() of it as zulong follows;
+ * resolved by tie_get(), not by rec_decode() */
+#define REC_REF         0x10
+/* Flags this version can decode */
+#define REC_FLAGS       (REC_DEFLATE | REC_ARRAY | REC_INT | REC_EXPIRE)
+
+/* Values shorter than this aren't compressed, without compressmin */
+#define REC_COMPRESSMIN 512
+
+static int tune_gdbm(char *nam, GDBM_FILE dbf, struct tieopts *opts, zulong dbsize);
+
+#define ADDINFO(name, value) (info[n++] = (name), info[n++] = (value))
+#define ADDNUMINFO(name, value) \
+    (convbase(info[n + 1] = zhalloc(DIGBUFSIZE), (value), 10), info[n] = (name), n += 2)
+
+/*
+ * Snapshot of a database, written by zgdbmsnapshot
+ * (to path of the database with ".snap" appended) and
+ * renamed into place, so it never changes once it can
+ * be opened. Readers (ztie -r -s) map it and take no
+ * lock, the writer can go on updating the database.
+ *
+ * The file starts with header, then come keys and
+ * values, metafied and null-terminated, one after
+ * the other, so values can be returned straight from
+ * the map. At `slotoff` is an open-addressing table
+ * (linear probing, at most half full) of hashes of
+ * metafied keys and offsets of the keys in the file.
+ */
+
+#define SNAP_MAGIC      "ZGSNAP01"
+
+struct snap_header {
+    char magic[8];
+    zulong nkeys;
+    zulong nslots;          /* power of 2 */
+    zulong slotoff;
+};
+
+struct snap_slot {
+    zulong hash;
+    zulong off;             /* 0 - empty slot */
+};
+
+struct zgdbm_snap {
+    char *map;
+    size_t size;
+    zulong nslots;
+    zulong slotoff;
+    struct snap_slot *slots;
+    struct zgdbm_snap *old; /* replaced, unmapped at the prompt */
+};
+
+/* Bucket cache of auto mode holds 1/4 of buckets, in these limits */
+#define TUNE_MIN_CACHE  100
+#define TUNE_MAX_CACHE  16384
+
+/* The GDBM engine */
+
+struct gdbmdb {
+    GDBM_FILE dbf;
+    datum content;          /* last fetched value */
+    datum key;              /* current key of iteration */
+    /* Shared mode only */
+    int lockfd;             /* of the sidecar, or -1 */
+    zulong gen;             /* generation the handle has read */
+    zulong seen;            /* generation cached values are of */
+    char *path;
+    int flags;              /* of gdbm_open() */
+    struct tieopts opts;
+    int depth;              /* of nested locks, the outer one is taken */
+    int dirty;              /* changed under the nested locks */
+};
+
+static void *gdbmdb_open(char *nam, char *path, int readonly, struct tieopts *opts);
+static void gdbmdb_close(void *db);
+static int gdbmdb_fetch(void *db, datum key, datum *content);
+static int gdbmdb_store(void *db, datum key, datum content, int replace);
+static int gdbmdb_delete(void *db, datum key);
+static int gdbmdb_firstkey(void *db, datum *key);
+static int gdbmdb_nextkey(void *db, datum *key);
+static zulong gdbmdb_count(void *db);
+static int gdbmdb_sync(void *db);
+static int gdbmdb_fd(void *db);
+static int gdbmdb_wipe(void *db);
+static int gdbmdb_info(void *db, char **info, int n);
+static int gdbmdb_changed(void *db);
+static int gdbmdb_hold(void *db, int hold);
+static int gdbmdb_lock(struct gdbmdb *gdb, int type);
+static void gdbmdb_unlock(struct gdbmdb *gdb, int changed);
+
+#ifdef ZGDBM_WRITEBEHIND
+#define GDBM_WBOPT  TOPT_BIT(TOPT_WRITEBEHIND)
+#else
+#define GDBM_WBOPT  0
+#endif
+#define GDBM_TIEOPTS \
+    (TOPT_BIT(TOPT_BLOCKSIZE) | TOPT_BIT(TOPT_CACHE) | TOPT_BIT(TOPT_MMAP) | \
+     TOPT_BIT(TOPT_MAXMAP) | TOPT_BIT(TOPT_CENTFREE) | TOPT_BIT(TOPT_COALESCE) | \
+     TOPT_BIT(TOPT_SYNC) | TOPT_BIT(TOPT_SHARED) | GDBM_WBOPT)
+
+static const struct zgdbm_backend gdbm_backend = {
+    "db/gdbm",
+    GDBM_TIEOPTS,
+    gdbmdb_open, gdbmdb_close, gdbmdb_fetch, gdbmdb_store, gdbmdb_delete,
+    gdbmdb_firstkey, gdbmdb_nextkey, gdbmdb_count, gdbmdb_sync, gdbmdb_fd,
+    gdbmdb_wipe, gdbmdb_info, NULL, NULL
+};
+
+/*
+ * The log-structured engine, for write-heavy ties.
+ *
+ * The file is a log of records, stores and deletes only
+ * append to it. Index of the live records, with offset
+ * and length of each value, is kept in memory and built
+ * by reading the log at open, so a read is one pread().
+ *
+ * The file starts with LOG_MAGIC, each record is header
+ * with length of key and of value, then the key and the
+ * value. Value length LOG_TOMBSTONE marks a delete. When
+ * more than half of the file is dead records, the file is
+ * rewritten with only live ones (compacted) - before the
+ * next prompt, or at untie.
+ */
+
+#define LOG_MAGIC           "ZGLOG001"
+#define LOG_TOMBSTONE       0xffffffffU
+#define LOG_COMPACT_MIN     ((off_t) 1 << 16)   /* least garbage worth it */
+
+struct log_rechdr {
+    unsigned int klen;
+    unsigned int vlen;
+};
+
+struct logent {
+    struct logent *next;
+    zulong hash;
+    off_t voff;             /* offset of value in the file */
+    unsigned int vlen;
+    unsigned int klen;
+    char key[1];            /* klen bytes follow */
+};
+
+struct logdb {
+    int fd;
+    pid_t pid;              /* of the shell that opened */
+    char *path;             /* unmetafied */
+    int readonly;
+    int sync;
+    off_t end;              /* end of the log */
+    off_t garbage;          /* bytes of dead records */
+    struct logent **buckets;
+    zulong nbuckets;
+    zulong count;
+    char *buf;              /* last fetched value */
+    size_t bufsize;
+    zulong iterbucket;      /* position of firstkey()/nextkey() */
+    struct logent *iterent;
+    int iterskip;           /* iterent was deleted, now it's the next one */
+    int compact;            /* compaction is due */
+};
+
+static void *logdb_open(char *nam, char *path, int readonly, struct tieopts *opts);
+static void logdb_close(void *db);
+static int logdb_fetch(void *db, datum key, datum *content);
+static int logdb_store(void *db, datum key, datum content, int replace);
+static int logdb_delete(void *db, datum key);
+static int logdb_firstkey(void *db, datum *key);
+static int logdb_nextkey(void *db, datum *key);
+static zulong logdb_count(void *db);
+static int logdb_sync(void *db);
+static int logdb_fd(void *db);
+static int logdb_wipe(void *db);
+static int logdb_info(void *db, char **info, int n);
+static void logdb_idle(void *db);
+static void logdb_reload(void *db);
+static int logdb_compact(struct logdb *ldb);
+static int logdb_tail(struct logdb *ldb);
+
+static const struct zgdbm_backend log_backend = {
+    "db/log",
+    TOPT_BIT(TOPT_SYNC),
+    logdb_open, logdb_close, logdb_fetch, logdb_store, logdb_delete,
+    logdb_firstkey, logdb_nextkey, logdb_count, logdb_sync, logdb_fd,
+    logdb_wipe, logdb_info, logdb_idle, logdb_reload
+};
+
+/*
+ * The constant database engine, for big tables that are
+ * built at once with zgdbmcdb and then only read (ztie
+ * -r). Like D. J. Bernstein's cdb, the file has a header
+ * with 256 hash tables, one chosen by the low byte of hash
+ * of a key. Then come records (header of log records, key,
+ * value), and the tables of hashes and offsets of records,
+ * at most half full, probed linearly from the slot chosen
+ * by further bits of the hash.
+ *
+ * The file is mapped, a lookup reads the header and the
+ * slot and compares the key in place - fetched values
+ * and keys point into the map, nothing is allocated. The
+ * file is never modified, it is replaced by rename(), so
+ * no lock is taken.
+ */
+
+#define CDB_MAGIC       "ZGCDB001"
+#define CDB_NTABLES     256
+
+struct cdb_table {
+    zulong off;
+    zulong nslots;          /* power of 2, or 0 */
+};
+
+struct cdb_header {
+    char magic[8];
+    zulong nkeys;
+    struct cdb_table tables[CDB_NTABLES];
+};
+
+struct cdbdb {
+    int fd;
+    char *map;
+    size_t size;
+    zulong itertable;       /* position of firstkey()/nextkey() */
+    zulong iterslot;
+};
+
+/* State of zgdbmcdb, slots of records are as in snapshots */
+struct cdbmake {
+    FILE *out;
+    char *tmppath;
+    zulong off;
+    struct snap_slot *recs;
+    zulong nrecs;
+    zulong recsize;
+    int err;
+};
+
+static void *cdbdb_open(char *nam, char *path, int readonly, struct tieopts *opts);
+static void cdbdb_close(void *db);
+static int cdbdb_fetch(void *db, datum key, datum *content);
+static int cdbdb_store(void *db, datum key, datum content, int replace);
+static int cdbdb_delete(void *db, datum key);
+static int cdbdb_firstkey(void *db, datum *key);
+static int cdbdb_nextkey(void *db, datum *key);
+static zulong cdbdb_count(void *db);
+static int cdbdb_sync(void *db);
+static int cdbdb_fd(void *db);
+static int cdbdb_wipe(void *db);
+static int cdbdb_info(void *db, char **info, int n);
+static int cdbmake_start(struct cdbmake *mk, const char *path);
+static void cdbmake_add(struct cdbmake *mk, const char *key, unsigned int klen,
+                        const char *val, unsigned int vlen);
+static int cdbmake_field(FILE *in, char **buf, size_t *size);
+static int cdbmake_finish(struct cdbmake *mk, const char *path);
+
+static const struct zgdbm_backend cdb_backend = {
+    "db/cdb",
+    0,
+    cdbdb_open, cdbdb_close, cdbdb_fetch, cdbdb_store, cdbdb_delete,
+    cdbdb_firstkey, cdbdb_nextkey, cdbdb_count, cdbdb_sync, cdbdb_fd,
+    cdbdb_wipe, cdbdb_info, NULL, NULL
+};
+
+#ifdef ZGDBM_WRITEBEHIND
+
+/*
+ * Write-behind queue of a tie (ztie -o writebehind=N).
+ * Stores and deletes are copied to a ring of N entries
+ * and return, a helper thread takes them in order and
+ * does them on the database. When the ring is full, the
+ * shell waits for a free entry.
+ *
+ * The thread only calls the engine, all memory is
+ * allocated and freed by the shell - entries the thread
+ * is done with are freed at the next store. The thread
+ * has all signals blocked. Only the GDBM engine doesn't
+ * use zsh's allocator, so the queue is its option.
+ *
+ * A lookup first searches the queue, so values not yet
+ * stored are found without waiting. Other operations
+ * wait until the queue is drained, as do untie and exit
+ * of the shell. A forked subshell has no thread, it
+ * uses the engine directly, without the stores that
+ * were still queued when it was forked.
+ */
+
+#define WB_MAXSIZE  ((zlong) 1 << 20)
+
+struct wbentry {
+    datum key;
+    datum content;          /* dptr NULL - a delete */
+};
+
+struct wbdb {
+    const struct zgdbm_backend *inner;
+    void *db;
+    pid_t pid;              /* process with the thread */
+    pthread_t thread;
+    pthread_mutex_t lock;   /* of the indices below */
+    pthread_mutex_t dblock; /* of the engine */
+    pthread_cond_t work;    /* signalled to the thread */
+    pthread_cond_t done;    /* signalled by the thread */
+    struct wbentry *queue;
+    zulong size;
+    zulong head;            /* next entry to queue */
+    zulong tail;            /* next entry to store */
+    zulong freed;           /* next entry to free */
+    zulong failed;
+    int stop;
+    int forking;            /* locked by wb_prefork() */
+    struct wbdb *next;      /* in `wb_list` */
+};
+
+/*
+ * Write-behind ties, for the fork handlers: a fork waits
+ * until the queues are drained, with the engines locked,
+ * so that a child gets them in a consistent state. It
+ * only reads them, the thread of the parent goes on
+ * writing. The handlers can't be removed, the module
+ * isn't unloaded once they're set.
+ */
+static struct wbdb *wb_list;
+static int wb_forkset;
+static void wb_prefork(void);
+static void wb_postfork(void);
+
+static void *wb_start(char *nam, const struct zgdbm_backend *inner, void *db, zlong size);
+static void *wb_thread(void *arg);
+static void wb_reclaim(struct wbdb *wb);
+static void wb_flush(struct wbdb *wb);
+static int wb_queue(struct wbdb *wb, datum key, datum content);
+static void wb_close(void *db);
+static int wb_fetch(void *db, datum key, datum *content);
+static int wb_store(void *db, datum key, datum content, int replace);
+static int wb_delete(void *db, datum key);
+static int wb_firstkey(void *db, datum *key);
+static int wb_nextkey(void *db, datum *key);
+static zulong wb_count(void *db);
+static int wb_sync(void *db);
+static int wb_fd(void *db);
+static int wb_wipe(void *db);
+static int wb_info(void *db, char **info, int n);
+
+static const struct zgdbm_backend wb_backend = {
+    "db/gdbm",
+    GDBM_TIEOPTS,
+    NULL, wb_close, wb_fetch, wb_store, wb_delete,
+    wb_firstkey, wb_nextkey, wb_count, wb_sync, wb_fd,
+    wb_wipe, wb_info, NULL, NULL
+};
+
+#endif /* ZGDBM_WRITEBEHIND */
+
+/* Engines ztie -d can choose */
+static const struct zgdbm_backend *backends[] = {
+    &gdbm_backend,
+    &log_backend,
+    &cdb_backend,
+    NULL
+};
 
 /**/
 static const struct gsu_hash gdbm_hash_gsu =
 { hashgetfn, gdbmhashsetfn, gdbmhashunsetfn };
 
+/* Copied into struct zgdbm_arr of each tied array */
+static const struct gsu_array gdbm_arr_gsu =
+{ gdbmarrgetfn, gdbmarrsetfn, gdbmarrunsetfn };
+
 static struct builtin bintab[] = {
-    BUILTIN("ztie", 0, bin_ztie, 1, -1, 0, "d:f:r", NULL),
+    BUILTIN("ztie", 0, bin_ztie, 1, -1, 0, "abd:f:l:o:rst:w", NULL),
     BUILTIN("zuntie", 0, bin_zuntie, 1, -1, 0, "u", NULL),
     BUILTIN("zgdbmpath", 0, bin_zgdbmpath, 1, -1, 0, "", NULL),
     BUILTIN("zgdbmclear", 0, bin_zgdbmclear, 2, -1, 0, "", NULL),
+    BUILTIN("zgdbmbloom", 0, bin_zgdbmbloom, 1, 1, 0, "", NULL),
+    BUILTIN("zgdbminfo", 0, bin_zgdbminfo, 1, 1, 0, "", NULL),
+    BUILTIN("zgdbmsnapshot", 0, bin_zgdbmsnapshot, 1, 1, 0, "", NULL),
+    BUILTIN("zgdbmcdb", 0, bin_zgdbmcdb, 1, -1, 0, "", NULL),
+    BUILTIN("zgdbmarray", 0, bin_zgdbmarray, 2, -1, 0, "ans", NULL),
+    BUILTIN("zgdbmincr", 0, bin_zgdbmincr, 2, 3, 0, "b", NULL),
+    BUILTIN("zgdbmcas", 0, bin_zgdbmcas, 3, 4, 0, "n", NULL),
+    BUILTIN("zgdbmexpire", 0, bin_zgdbmexpire, 2, 3, 0, NULL, NULL),
+    BUILTIN("zgdbmtrace", 0, bin_zgdbmtrace, 1, 2, 0, "b", NULL),
+    BUILTIN("zgdbmslice", 0, bin_zgdbmslice, 2, 3, 0, NULL, NULL),
+    BUILTIN("zgdbmpush", 0, bin_zgdbmpush, 1, -1, 0, NULL, NULL),
 };
 
 #define ROARRPARAMDEF(name, var) \
@@ -108,9 +1041,14 @@ static int
 bin_ztie(char *nam, char **args, Options ops, UNUSED(int func))
 {
     char *resource_name, *pmname;
-    GDBM_FILE dbf = NULL;
-    int read_write = GDBM_SYNC, pmflags = PM_REMOVABLE;
+    const struct zgdbm_backend **backend, *engine;
+    void *db = NULL;
+    struct zgdbm_snap *snap = NULL;
+    int pmflags = PM_REMOVABLE, i;
     Param tied_param;
+    struct tieopts opts;
+    double timeout = 0;
+    zlong waited = 0;
 
     if(!OPT_ISSET(ops,'d')) {
         zwarnnam(nam, "you must pass `-d %s'", backtype);
@@ -121,15 +1059,18 @@ bin_ztie(char *nam, char **args, Options ops, UNUSED(int func))
 	return 1;
     }
     if (OPT_ISSET(ops,'r')) {
-	read_write |= GDBM_READER;
 	pmflags |= PM_READONLY;
-    } else {
-	read_write |= GDBM_WRCREAT;
+    } else if (OPT_ISSET(ops,'s')) {
+        zwarnnam(nam, "snapshot can be only tied read-only (-r)", NULL);
+	return 1;
     }
 
-    /* Here should be a lookup of the backend type against
-     * a registry, if generam DB mechanism is to be added */
-    if (strcmp(OPT_ARG(ops, 'd'), backtype) != 0) {
+    /* Lookup of the backend type in the registry */
+    for (backend = backends; *backend; backend++) {
+        if (!strcmp(OPT_ARG(ops, 'd'), (*backend)->name))
+            break;
+    }
+    if (!*backend) {
         zwarnnam(nam, "unsupported backend type `%s'", OPT_ARG(ops, 'd'));
 	return 1;
     }
@@ -137,6 +1078,91 @@ bin_ztie(char *nam, char **args, Options ops, UNUSED(int func))
     resource_name = OPT_ARG(ops, 'f');
     pmname = *args;
 
+    memset(&opts, 0, sizeof(opts));
+    if (OPT_ISSET(ops,'o') && parse_tieopts(nam, OPT_ARG(ops,'o'), &opts))
+	return 1;
+    for (i = 0; i < TOPT_COUNT; i++) {
+        if ((opts.set & TOPT_BIT(i)) && !(((*backend)->opts | TOPT_TIEMASK) & TOPT_BIT(i))) {
+            zwarnnam(nam, "option %s isn't supported by %s", tieopt_names[i],
+                     (*backend)->name);
+            return 1;
+        }
+    }
+    /* Plain `auto' applies to what the backend has */
+    opts.autoset &= (*backend)->opts;
+
+    if (OPT_ISSET(ops,'l') && OPT_ISSET(ops,'s')) {
+        zwarnnam(nam, "loader function (-l) is for a database, not a snapshot (-s)");
+        return 1;
+    }
+    if (opts.val[TOPT_TTL] > 0 && OPT_ISSET(ops,'s')) {
+        zwarnnam(nam, "option ttl is for a database, not a snapshot (-s)");
+        return 1;
+    }
+    if (opts.val[TOPT_WARM] > 0 && OPT_ISSET(ops,'s')) {
+        zwarnnam(nam, "option warm is for a database, not a snapshot (-s)");
+        return 1;
+    }
+    if (opts.val[TOPT_DEDUP] > 0 && OPT_ISSET(ops,'s')) {
+        zwarnnam(nam, "option dedup is for a database, not a snapshot (-s)");
+        return 1;
+    }
+    if (OPT_ISSET(ops,'a') &&
+        (OPT_ISSET(ops,'b') || OPT_ISSET(ops,'l') || OPT_ISSET(ops,'s') || OPT_ISSET(ops,'w') ||
+         (opts.set & (TOPT_BIT(TOPT_IDLE) | TOPT_BIT(TOPT_TTL) | TOPT_BIT(TOPT_WARM) |
+                      TOPT_BIT(TOPT_DEDUP))))) {
+        zwarnnam(nam, "array (-a) can't be tied with -b, -l, -s, -w, idle, ttl, warm or dedup");
+        return 1;
+    }
+    if (opts.set & TOPT_BIT(TOPT_IDLE)) {
+        if (OPT_ISSET(ops,'s')) {
+            zwarnnam(nam, "option idle is for a database, not a snapshot (-s)");
+            return 1;
+        }
+        if (opts.val[TOPT_WRITEBEHIND] > 0) {
+            zwarnnam(nam, "options idle and writebehind can't be used together");
+            return 1;
+        }
+    }
+#ifndef ZGDBM_ZLIB
+    if (opts.val[TOPT_COMPRESS] > 0) {
+        zwarnnam(nam, "compression isn't available, zsh was built without zlib");
+        return 1;
+    }
+#endif
+    if (opts.val[TOPT_COMPRESS] > 9) {
+        zwarnnam(nam, "bad value for option compress: %L (1-9)",
+                 (long) opts.val[TOPT_COMPRESS]);
+        return 1;
+    }
+    if (opts.val[TOPT_SHARED]) {
+        /* Keys added by others wouldn't be in the filter */
+        if (OPT_ISSET(ops,'b')) {
+            zwarnnam(nam, "bloom filter (-b) can't be used with option shared");
+            return 1;
+        }
+        if (opts.val[TOPT_WRITEBEHIND] > 0) {
+            zwarnnam(nam, "options shared and writebehind can't be used together");
+            return 1;
+        }
+    }
+    /* Own writes reach the file later, they'd look like others' */
+    if (OPT_ISSET(ops,'w') && !OPT_ISSET(ops,'r') && opts.val[TOPT_WRITEBEHIND] > 0) {
+        zwarnnam(nam, "watch (-w) can't be used with option writebehind");
+        return 1;
+    }
+
+    if (OPT_ISSET(ops,'t')) {
+        char *end;
+
+        timeout = strtod(OPT_ARG(ops,'t'), &end);
+        if (*end || end == OPT_ARG(ops,'t') || timeout < 0) {
+            zwarnnam(nam, "bad timeout: %s", OPT_ARG(ops,'t'));
+            return 1;
+        }
+        opts.retry = 1;
+    }
+
     if ((tied_param = (Param)paramtab->getnode(paramtab, pmname)) &&
 	!(tied_param->node.flags & PM_UNSET)) {
 	/*
@@ -156,32 +1182,84 @@ bin_ztie(char *nam, char **args, Options ops, UNUSED(int func))
 	    return 1;
     }
 
-    gdbm_errno=0;
-    dbf = gdbm_open(resource_name, 0, read_write, 0666, 0);
-    if(dbf == NULL) {
-	zwarnnam(nam, "error opening database file %s (%s)", resource_name, gdbm_strerror(gdbm_errno));
+    if (OPT_ISSET(ops,'s')) {
+	/* Only the snapshot, no database and no locks */
+	if (!(snap = snap_open(unmeta(dyncat(resource_name, ".snap"))))) {
+	    zwarnnam(nam, "error opening snapshot %s.snap (%e)", resource_name, errno);
+	    return 1;
+	}
+    } else if (!(db = tie_open(nam, *backend, resource_name, OPT_ISSET(ops,'r'),
+                               &opts, timeout, &waited))) {
+	/* Reported by the backend */
 	return 1;
     }
 
+    engine = *backend;
+#ifdef ZGDBM_WRITEBEHIND
+    if (db && !OPT_ISSET(ops,'r') && opts.val[TOPT_WRITEBEHIND] > 0) {
+        void *wb = wb_start(nam, engine, db, opts.val[TOPT_WRITEBEHIND]);
+
+        if (!wb) {
+            engine->close(db);
+            return 1;
+        }
+        db = wb;
+        engine = &wb_backend;
+    }
+#endif
+
+    if (OPT_ISSET(ops,'a'))
+        return arr_tie(nam, pmname, pmflags, engine, db, &opts, resource_name, waited);
+
     if (!(tied_param = createhash(pmname, pmflags))) {
         zwarnnam(nam, "cannot create the requested parameter %s", pmname);
-	fdtable[gdbm_fdesc(dbf)] = FDT_UNUSED;
-	gdbm_close(dbf);
+	if (db)
+	    engine->close(db);
+	else
+	    snap_close(snap);
 	return 1;
     }
 
-    addmodulefd(gdbm_fdesc(dbf), FDT_MODULE);
+    if (db && engine->fd(db) != -1)
+	addmodulefd(engine->fd(db), FDT_MODULE);
     append_tied_name(pmname);
 
     tied_param->gsu.h = &gdbm_hash_gsu;
 
-    /* Allocate parameter sub-gsu, fill dbf field. 
-     * dbf allocation is 1 to 1 accompanied by
+    /* Allocate parameter sub-gsu, fill db field.
+     * db allocation is 1 to 1 accompanied by
      * gsu_scalar_ext allocation. */
 
     struct gsu_scalar_ext *dbf_carrier = (struct gsu_scalar_ext *) zalloc(sizeof(struct gsu_scalar_ext));
     dbf_carrier->std = gdbm_gsu_ext.std;
-    dbf_carrier->dbf = dbf;
+    dbf_carrier->backend = engine;
+    dbf_carrier->db = db;
+    dbf_carrier->arena = dbf_carrier->arena_full = NULL;
+    dbf_carrier->bloom = NULL;
+    dbf_carrier->tuned = opts.autoset;
+    dbf_carrier->snap = snap;
+    dbf_carrier->opts = (struct tieopts *) zalloc(sizeof(struct tieopts));
+    *dbf_carrier->opts = opts;
+    dbf_carrier->watch = NULL;
+    dbf_carrier->chlog = NULL;
+    dbf_carrier->waited = waited;
+    dbf_carrier->lazy = NULL;
+    dbf_carrier->ht = tied_param->u.hash;
+    dbf_carrier->zcount = dbf_carrier->zraw = dbf_carrier->zstored = 0;
+    dbf_carrier->sweep = NULL;
+    dbf_carrier->loader = OPT_ISSET(ops,'l') ? ztrdup(OPT_ARG(ops,'l')) : NULL;
+    dbf_carrier->loading = 0;
+    dbf_carrier->warm = NULL;
+    dbf_carrier->dedup = NULL;
+    dbf_carrier->freenodes = NULL;
+    memset(dbf_carrier->freebufs, 0, sizeof(dbf_carrier->freebufs));
+    dbf_carrier->freebytes = 0;
+    if (opts.val[TOPT_TTL] > 0)
+        dbf_carrier->sweep = (struct zgdbm_sweep *) zshcalloc(sizeof(struct zgdbm_sweep));
+    if (opts.val[TOPT_DEDUP] > 0) {
+        dbf_carrier->dedup = (struct zgdbm_dedup *) zshcalloc(sizeof(struct zgdbm_dedup));
+        dbf_carrier->dedup->min = opts.val[TOPT_DEDUP];
+    }
     tied_param->u.hash->tmpdata = (void *)dbf_carrier;
 
     /* Fill also file path field */
@@ -191,16 +1269,658 @@ bin_ztie(char *nam, char **args, Options ops, UNUSED(int func))
         resource_name = xsymlink(resource_name, 1);
     }
     dbf_carrier->dbfile_path = ztrdup(resource_name);
+
+    /* Filter of present keys, from the sidecar file
+     * if it describes current database, else scanned */
+    if (db && OPT_ISSET(ops,'b') && bloom_load(dbf_carrier) && bloom_build(dbf_carrier)) {
+        zwarnnam(nam, "cannot build bloom filter for %s, not using it", pmname);
+    }
+
+    if (db && !OPT_ISSET(ops,'r') && chlog_open(dbf_carrier)) {
+        zwarnnam(nam, "cannot share changes of %s with subshells (%e)", pmname, errno);
+    }
+
+    if (OPT_ISSET(ops,'w') &&
+        watch_start(dbf_carrier, snap ? dyncat(dbf_carrier->dbfile_path, ".snap")
+                    : dbf_carrier->dbfile_path, OPT_ISSET(ops,'r'))) {
+        zwarnnam(nam, "cannot watch %s for changes (%e), not doing it", resource_name, errno);
+    }
+
+    /* Keys used most the last time, fetched ahead */
+    if (db && opts.val[TOPT_WARM] > 0) {
+        dbf_carrier->warm = (struct zgdbm_warm *) zshcalloc(sizeof(struct zgdbm_warm));
+        warm_load(dbf_carrier);
+    }
+
+    /* Opened only to check it can be, next at first use */
+    if (opts.set & TOPT_BIT(TOPT_IDLE)) {
+        struct zgdbm_lazy *lazy = (struct zgdbm_lazy *) zshcalloc(sizeof(struct zgdbm_lazy));
+
+        lazy->readonly = OPT_ISSET(ops,'r');
+        lazy->timeout = OPT_ISSET(ops,'t') ? timeout : TIE_LAZYWAIT;
+        dbf_carrier->lazy = lazy;
+        dbf_carrier->opts->retry = 1;
+        tie_close(dbf_carrier);
+    }
     return 0;
 }
 
-/**/
-static int
-bin_zuntie(char *nam, char **args, Options ops, UNUSED(int func))
-{
-    Param pm;
-    char *pmname;
-    int ret = 0;
+/*
+ * Random part of a backoff sleep, 0 to max. Not from
+ * rand(), that would change the sequence of $RANDOM.
+ * Seeded again in a forked subshell, so that it doesn't
+ * wait as long as its parent.
+ */
+
+static long tie_jitter(long max) {
+    static zulong state;
+    static pid_t seeded;
+    struct timeval tv;
+    struct timezone dummy_tz;
+
+    if (seeded != getpid()) {
+        seeded = getpid();
+        gettimeofday(&tv, &dummy_tz);
+        state = ((zulong) seeded << 32) ^ (zulong) tv.tv_sec ^
+            ((zulong) tv.tv_usec << 12) ^ (zulong) 0x9e3779b97f4a7c15ULL;
+    }
+
+    /* xorshift64 */
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (long) (state % (zulong) (max + 1));
+}
+
+/*
+ * Opens the database for ztie. With -t, while the lock is
+ * held by another process, tries again after doubling,
+ * partly random sleeps, until `timeout` seconds passed.
+ * Time spent is returned in `waited`, in milliseconds.
+ */
+
+static void *
+tie_open(char *nam, const struct zgdbm_backend *backend, char *path, int readonly,
+         struct tieopts *opts, double timeout, zlong *waited)
+{
+    struct timeval start, now, tv;
+    struct timezone dummy_tz;
+    long backoff = 1000, left, us;
+    zlong tstart = TRACE_START();
+    void *db;
+
+    gettimeofday(&start, &dummy_tz);
+    for (;;) {
+        db = backend->open(nam, path, readonly, opts);
+        if (db || !opts->retry || errno != EWOULDBLOCK)
+            break;
+
+        gettimeofday(&now, &dummy_tz);
+        left = (long) (timeout * 1000000) -
+            ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_usec - start.tv_usec));
+        if (left <= 0 || (errflag & ERRFLAG_INT)) {
+            zwarnnam(nam, "database file %s is locked by another process", path);
+            break;
+        }
+
+        /* Unlike the time another waiting shell chose */
+        us = backoff / 2 + tie_jitter(backoff / 2);
+        if (us > left)
+            us = left;
+        tv.tv_sec = us / 1000000L;
+        tv.tv_usec = us % 1000000L;
+        select(0, NULL, NULL, NULL, &tv);
+        if (backoff < TIE_MAXBACKOFF)
+            backoff *= 2;
+    }
+
+    gettimeofday(&now, &dummy_tz);
+    *waited = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+    if (tstart)
+        trace_add(TRACE_OPEN, tstart, keyhash(path, strlen(path)), 0);
+    return db;
+}
+
+/* Drops all cached values of the tied hash */
+
+static void tie_forget(HashTable ht) {
+    HashNode hn;
+    int i;
+
+    for (i = 0; i < ht->hsize; i++) {
+        for (hn = ht->nodes[i]; hn; hn = hn->next) {
+            ((Param) hn)->node.flags &= ~PM_UPTODATE;
+        }
+    }
+}
+
+/*
+ * Closes database of a lazy tie until its next use,
+ * remembering the file to tell at reopen whether it
+ * was written in the meantime.
+ */
+
+static void tie_close(struct gsu_scalar_ext *gsu_ext) {
+    struct zgdbm_lazy *lazy = gsu_ext->lazy;
+    int fd;
+
+    if (!gsu_ext->db)
+        return;
+
+    /* Written while still locked, as at zuntie */
+    if (gsu_ext->bloom && gsu_ext->bloom->dirty)
+        (void)bloom_save(gsu_ext);
+
+    if ((fd = gsu_ext->backend->fd(gsu_ext->db)) != -1)
+        fdtable[fd] = FDT_UNUSED;
+    gsu_ext->backend->close(gsu_ext->db);
+    gsu_ext->db = NULL;
+
+    if (stat(unmeta(gsu_ext->dbfile_path), &lazy->st))
+        memset(&lazy->st, 0, sizeof(lazy->st));
+}
+
+/*
+ * Opens database of a lazy tie if it's closed, waiting
+ * for the lock like ztie -t, and drops cached values
+ * written by others in the meantime - also when they
+ * share the database with this open tie. Returns
+ * non-zero if there is no database to use.
+ */
+
+static int tie_ensure(struct gsu_scalar_ext *gsu_ext) {
+    if (gsu_ext->lazy) {
+        gsu_ext->lazy->used = time(NULL);
+        if (!gsu_ext->db && tie_reopen(gsu_ext))
+            return 1;
+    }
+    if (!gsu_ext->db)
+        return 1;
+
+    if (gsu_ext->opts->val[TOPT_SHARED] && gdbmdb_changed(gsu_ext->db))
+        tie_forget(gsu_ext->ht);
+    return 0;
+}
+
+/*
+ * Keeps the database of a shared tie locked from hold 1
+ * to hold 0, for read-modify-write of a value. Other
+ * ties have the lock for all the time they're open.
+ */
+
+static int tie_hold(struct gsu_scalar_ext *gsu_ext, int hold) {
+    if (!gsu_ext->opts->val[TOPT_SHARED] || !gsu_ext->db)
+        return 0;
+    return gdbmdb_hold(gsu_ext->db, hold);
+}
+
+/*
+ * Key of the shared value with hash `h`, in `buf` of
+ * DEDUP_KEYLEN bytes.
+ */
+
+static datum dedup_key(char *buf, zulong h) {
+    datum key;
+
+    memcpy(buf, DEDUP_MAGIC, DEDUP_MAGICLEN);
+    memcpy(buf + DEDUP_MAGICLEN, &h, sizeof(h));
+    key.dptr = buf;
+    key.dsize = DEDUP_KEYLEN;
+    return key;
+}
+
+/*
+ * Whether record is a reference to a shared value,
+ * then sets its hash.
+ */
+
+static int rec_isref(datum in, zulong *h) {
+    if (in.dsize != REC_HDRLEN + (int) sizeof(zulong) ||
+        memcmp(in.dptr, REC_MAGIC, REC_MAGICLEN) || in.dptr[REC_MAGICLEN] != REC_REF)
+        return 0;
+    memcpy(h, in.dptr + REC_HDRLEN, sizeof(*h));
+    return 1;
+}
+
+/*
+ * Fetches a record, the shared value for a reference -
+ * by any tie, also one without dedup.
+ */
+
+static int tie_get(struct gsu_scalar_ext *gsu_ext, datum key, datum *content) {
+    char vkey[DEDUP_KEYLEN];
+    zulong h;
+
+    if (gsu_ext->backend->fetch(gsu_ext->db, key, content))
+        return 1;
+    if (!rec_isref(*content, &h))
+        return 0;
+    if (gsu_ext->backend->fetch(gsu_ext->db, dedup_key(vkey, h), content) ||
+        content->dsize < (int) sizeof(zulong))
+        return 1;
+    content->dptr += sizeof(zulong);
+    content->dsize -= sizeof(zulong);
+    return 0;
+}
+
+/*
+ * Drops a reference to the shared value with hash `h`,
+ * deleting the value with the last one.
+ */
+
+static void dedup_unref(struct gsu_scalar_ext *gsu_ext, zulong h) {
+    const struct zgdbm_backend *backend = gsu_ext->backend;
+    char vkey[DEDUP_KEYLEN];
+    datum key = dedup_key(vkey, h), shared;
+    zulong refs;
+    char *copy;
+
+    if (backend->fetch(gsu_ext->db, key, &shared) || shared.dsize < (int) sizeof(zulong))
+        return;
+    memcpy(&refs, shared.dptr, sizeof(refs));
+    if (refs <= 1) {
+        (void)backend->delete(gsu_ext->db, key);
+        return;
+    }
+    refs--;
+    copy = (char *) zhalloc(shared.dsize);
+    memcpy(copy, shared.dptr, shared.dsize);
+    memcpy(copy, &refs, sizeof(refs));
+    shared.dptr = copy;
+    (void)backend->store(gsu_ext->db, key, shared, 1);
+}
+
+/*
+ * Stores a record as store() of the backend does. With
+ * ztie -o dedup=N, one of at least N bytes becomes a
+ * reference to the shared value, and the reference the
+ * key held before is dropped - all under the hold, so
+ * shells sharing the database count the same.
+ */
+
+static int tie_store(struct gsu_scalar_ext *gsu_ext, datum key, datum content, int replace) {
+    const struct zgdbm_backend *backend = gsu_ext->backend;
+    struct zgdbm_dedup *dedup = gsu_ext->dedup;
+    char vkey[DEDUP_KEYLEN], ref[REC_HDRLEN + sizeof(zulong)];
+    datum old, vk, shared;
+    zulong oldh = 0, h = 0, refs;
+    int hadref = 0, isref = 0, ret;
+    char *copy;
+
+    if (!tie_keyok(key))
+        return -1;
+    if (!dedup)
+        return backend->store(gsu_ext->db, key, content, replace);
+
+    /* The record can be in a buffer of the backend,
+     * fetches below would overwrite it */
+    copy = (char *) zhalloc(content.dsize + 1);
+    memcpy(copy, content.dptr, content.dsize);
+    content.dptr = copy;
+
+    if (tie_hold(gsu_ext, 1))
+        return -1;
+    if (!backend->fetch(gsu_ext->db, key, &old)) {
+        if (!replace) {
+            tie_hold(gsu_ext, 0);
+            return 1;
+        }
+        hadref = rec_isref(old, &oldh);
+    }
+
+    if (content.dsize >= dedup->min) {
+        h = keyhash(content.dptr, content.dsize);
+        vk = dedup_key(vkey, h);
+        if (backend->fetch(gsu_ext->db, vk, &shared)) {
+            refs = 1;
+            isref = 1;
+        } else if (shared.dsize - (int) sizeof(zulong) == content.dsize &&
+                   !memcmp(shared.dptr + sizeof(zulong), content.dptr, content.dsize)) {
+            if (hadref && oldh == h) {
+                /* Already refers to it */
+                tie_hold(gsu_ext, 0);
+                return 0;
+            }
+            memcpy(&refs, shared.dptr, sizeof(refs));
+            refs++;
+            isref = 1;
+            dedup->shared++;
+        }
+        if (isref) {
+            shared.dsize = sizeof(zulong) + content.dsize;
+            shared.dptr = (char *) zhalloc(shared.dsize);
+            memcpy(shared.dptr, &refs, sizeof(refs));
+            memcpy(shared.dptr + sizeof(zulong), content.dptr, content.dsize);
+            if (backend->store(gsu_ext->db, vk, shared, 1)) {
+                tie_hold(gsu_ext, 0);
+                return -1;
+            }
+            memcpy(ref, REC_MAGIC, REC_MAGICLEN);
+            ref[REC_MAGICLEN] = REC_REF;
+            memcpy(ref + REC_HDRLEN, &h, sizeof(h));
+            content.dptr = ref;
+            content.dsize = sizeof(ref);
+        }
+    }
+
+    ret = backend->store(gsu_ext->db, key, content, 1);
+    if (ret && isref)
+        dedup_unref(gsu_ext, h);
+    else if (!ret && hadref)
+        dedup_unref(gsu_ext, oldh);
+    tie_hold(gsu_ext, 0);
+    return ret;
+}
+
+/*
+ * Deletes a record as delete() of the backend does,
+ * dropping the reference it held with ztie -o dedup=N.
+ */
+
+static int tie_delete(struct gsu_scalar_ext *gsu_ext, datum key) {
+    const struct zgdbm_backend *backend = gsu_ext->backend;
+    datum old;
+    zulong h;
+    int hadref, ret;
+
+    if (!tie_keyok(key))
+        return -1;
+    if (!gsu_ext->dedup)
+        return backend->delete(gsu_ext->db, key);
+
+    if (tie_hold(gsu_ext, 1))
+        return -1;
+    hadref = !backend->fetch(gsu_ext->db, key, &old) && rec_isref(old, &h);
+    if (!(ret = backend->delete(gsu_ext->db, key)) && hadref)
+        dedup_unref(gsu_ext, h);
+    tie_hold(gsu_ext, 0);
+    return ret;
+}
+
+/*
+ * Keys starting with magic of records the module keeps
+ * for itself would be hidden by them, or overwrite them.
+ * They can't be written through the tie.
+ */
+
+static int tie_keyok(datum key) {
+    if (TIE_RESERVED(key)) {
+        zwarn("key is reserved by zgdbm: %s", metafy(key.dptr, key.dsize, META_HEAPDUP));
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Returns the interned copy of a value, made in the
+ * arena at its first use.
+ */
+
+static char *dedup_intern(struct gsu_scalar_ext *gsu_ext, const char *val) {
+    struct zgdbm_dedup *dedup = gsu_ext->dedup;
+    zulong i, mask;
+    Heap oldheaps;
+    char *str;
+
+    if (2 * (dedup->count + 1) > dedup->size) {
+        zulong size = dedup->size ? 2 * dedup->size : 64, j;
+        char **strs = (char **) zshcalloc(size * sizeof(char *));
+
+        for (j = 0; j < dedup->size; j++) {
+            if (!(str = dedup->strs[j]))
+                continue;
+            for (i = keyhash(str, strlen(str)) & (size - 1); strs[i]; i = (i + 1) & (size - 1))
+                ;
+            strs[i] = str;
+        }
+        if (dedup->strs)
+            zfree(dedup->strs, dedup->size * sizeof(char *));
+        dedup->strs = strs;
+        dedup->size = size;
+    }
+
+    mask = dedup->size - 1;
+    for (i = keyhash(val, strlen(val)) & mask; (str = dedup->strs[i]); i = (i + 1) & mask) {
+        if (!strcmp(str, val))
+            return str;
+    }
+
+    oldheaps = arena_enter(gsu_ext);
+    str = dupstring(val);
+    arena_leave(gsu_ext, oldheaps);
+    dedup->strs[i] = str;
+    dedup->count++;
+    return str;
+}
+
+/*
+ * Whether `str` is (the buffer of) an interned value.
+ */
+
+static int dedup_interned(struct zgdbm_dedup *dedup, const char *str) {
+    zulong i, mask;
+
+    if (!dedup->size)
+        return 0;
+    mask = dedup->size - 1;
+    for (i = keyhash(str, strlen(str)) & mask; dedup->strs[i]; i = (i + 1) & mask) {
+        if (dedup->strs[i] == str)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Empties the table of interned values, before the
+ * arena holding them is released.
+ */
+
+static void dedup_forget(struct zgdbm_dedup *dedup) {
+    if (dedup->strs)
+        zfree(dedup->strs, dedup->size * sizeof(char *));
+    dedup->strs = NULL;
+    dedup->size = dedup->count = 0;
+}
+
+/*
+ * Fetches a record, one that expired is absent.
+ */
+
+static int tie_fetch(struct gsu_scalar_ext *gsu_ext, datum key, datum *content) {
+    zlong when;
+
+    if (tie_get(gsu_ext, key, content))
+        return 1;
+    when = rec_expiry(*content);
+    return when && when <= (zlong) time(NULL);
+}
+
+/*
+ * Deletes expired keys among the next TIE_SWEEPSLICE ones.
+ * Keys aren't deleted while iterating, the next slice
+ * starts at a key found alive.
+ */
+
+static void tie_sweep(struct gsu_scalar_ext *gsu_ext) {
+    struct zgdbm_sweep *sweep = gsu_ext->sweep;
+    const struct zgdbm_backend *backend = gsu_ext->backend;
+    datum key, content, *dead;
+    zlong now = time(NULL), when;
+    int ret, i, n, ndead = 0;
+
+    if (tie_hold(gsu_ext, 1))
+        return;
+
+    if (sweep->key) {
+        /* The key can be gone, then the sweep starts over */
+        key.dptr = sweep->key;
+        key.dsize = sweep->klen;
+        ret = 0;
+    } else {
+        ret = backend->firstkey(gsu_ext->db, &key);
+    }
+
+    dead = (datum *) zhalloc(TIE_SWEEPSLICE * sizeof(datum));
+    for (n = 0; !ret && n < TIE_SWEEPSLICE; n++) {
+        if (!TIE_RESERVED(key) && !tie_get(gsu_ext, key, &content) &&
+            (when = rec_expiry(content)) && when <= now) {
+            dead[ndead].dptr = (char *) hcalloc(key.dsize + 1);
+            memcpy(dead[ndead].dptr, key.dptr, key.dsize);
+            dead[ndead++].dsize = key.dsize;
+        }
+        ret = backend->nextkey(gsu_ext->db, &key);
+    }
+
+    if (sweep->key)
+        zfree(sweep->key, sweep->klen);
+    sweep->key = NULL;
+    if (!ret) {
+        sweep->key = (char *) zalloc(key.dsize);
+        memcpy(sweep->key, key.dptr, key.dsize);
+        sweep->klen = key.dsize;
+    }
+
+    for (i = 0; i < ndead; i++) {
+        HashNode hn;
+        char *name;
+
+        if (tie_delete(gsu_ext, dead[i]))
+            continue;
+        sweep->expired++;
+        name = metafy(dead[i].dptr, dead[i].dsize, META_HEAPDUP);
+        chlog_note(gsu_ext, name);
+        if ((hn = gethashnode2(gsu_ext->ht, name))) {
+            ((Param) hn)->node.flags &= ~PM_UPTODATE;
+        }
+    }
+    tie_hold(gsu_ext, 0);
+}
+
+/*
+ * Runs the loader function of the tie with the missing
+ * key (metafied `name`) as argument. When it returns
+ * status 0, $REPLY is stored as the value and returned,
+ * on the heap, with time the record expires at in
+ * `expires`. NULL is returned when the function fails,
+ * or when another shell loaded the key meanwhile.
+ */
+
+static char *tie_load(struct gsu_scalar_ext *gsu_ext, char *name, datum key, zlong *expires) {
+    const struct zgdbm_backend *backend = gsu_ext->backend;
+    struct load_lock lock, other;
+    datum lockkey, lockval, content;
+    struct timeval tv;
+    long backoff = 1000, us;
+    int locked = 0, oldval = lastval, status, ret;
+    char *val, *umval;
+
+    lockkey.dsize = LOAD_MAGICLEN + key.dsize;
+    lockkey.dptr = (char *) zhalloc(lockkey.dsize);
+    memcpy(lockkey.dptr, LOAD_MAGIC, LOAD_MAGICLEN);
+    memcpy(lockkey.dptr + LOAD_MAGICLEN, key.dptr, key.dsize);
+    memset(&lock, 0, sizeof(lock));
+    lock.pid = getpid();
+    lock.started = time(NULL);
+    lockval.dptr = (char *) &lock;
+    lockval.dsize = sizeof(lock);
+
+    /* Store fails (-1) for a read-only tie, loading without the lock */
+    while ((ret = backend->store(gsu_ext->db, lockkey, lockval, 0)) == 1) {
+        if (!tie_fetch(gsu_ext, key, &content))
+            return NULL;
+        if (errflag & ERRFLAG_INT)
+            return NULL;
+
+        /* Lock record as it is now, checked and taken over at once */
+        if (tie_hold(gsu_ext, 1))
+            return NULL;
+        if (!backend->fetch(gsu_ext->db, lockkey, &content) &&
+            content.dsize == sizeof(other)) {
+            memcpy(&other, content.dptr, sizeof(other));
+            if (other.started + TIE_LOADWAIT <= lock.started ||
+                (kill(other.pid, 0) && errno == ESRCH))
+                ret = backend->store(gsu_ext->db, lockkey, lockval, 1);
+        }
+        tie_hold(gsu_ext, 0);
+        if (ret != 1)
+            break;
+
+        us = backoff / 2 + tie_jitter(backoff / 2);
+        tv.tv_sec = us / 1000000L;
+        tv.tv_usec = us % 1000000L;
+        select(0, NULL, NULL, NULL, &tv);
+        if (backoff < TIE_MAXBACKOFF)
+            backoff *= 2;
+        lock.started = time(NULL);
+    }
+    locked = !ret;
+
+    gsu_ext->loading = 1;
+    execstring(zhtricat(gsu_ext->loader, " ", quotestring(name, QT_SINGLE)),
+               1, 0, "hook");
+    gsu_ext->loading = 0;
+    status = lastval;
+    lastval = oldval;
+
+    val = status ? NULL : getsparam("REPLY");
+    if (val) {
+        int umlen;
+
+        val = dupstring(val);
+        umval = dupstring(val);
+        unmetafy(umval, &umlen);
+        content.dptr = umval;
+        content.dsize = umlen;
+        rec_encode(gsu_ext, content, 0, 0, &content);
+        *expires = rec_expiry(content);
+        if (!tie_store(gsu_ext, key, content, 1)) {
+            chlog_note(gsu_ext, name);
+            bloom_add(gsu_ext, key.dptr, key.dsize);
+        }
+    }
+    if (locked)
+        (void)backend->delete(gsu_ext->db, lockkey);
+    return val;
+}
+
+static int tie_reopen(struct gsu_scalar_ext *gsu_ext) {
+    struct zgdbm_lazy *lazy = gsu_ext->lazy;
+    struct stat st;
+    zlong waited;
+    void *db;
+    int fd;
+
+    if (!(db = tie_open("ztie", gsu_ext->backend, gsu_ext->dbfile_path, lazy->readonly,
+                        gsu_ext->opts, lazy->timeout, &waited)))
+        return 1;
+    gsu_ext->db = db;
+    gsu_ext->waited += waited;
+    lazy->opens++;
+
+    fd = gsu_ext->backend->fd(db);
+    if (fd != -1)
+        addmodulefd(fd, FDT_MODULE);
+
+    /* Changed by other writers while closed? */
+    if ((fd != -1 ? fstat(fd, &st) : stat(unmeta(gsu_ext->dbfile_path), &st)) ||
+        st_changed(&st, &lazy->st)) {
+        tie_forget(gsu_ext->ht);
+        if (gsu_ext->bloom) {
+            bloom_free(gsu_ext);
+            if (bloom_load(gsu_ext))
+                (void)bloom_build(gsu_ext);
+        }
+    }
+    return 0;
+}
+
+/**/
+static int
+bin_zuntie(char *nam, char **args, Options ops, UNUSED(int func))
+{
+    Param pm;
+    char *pmname;
+    int ret = 0;
 
     for (pmname = *args; *args++; pmname = *args) {
 	pm = (Param) paramtab->getnode(paramtab, pmname);
@@ -209,15 +1929,20 @@ bin_zuntie(char *nam, char **args, Options ops, UNUSED(int func))
 	    ret = 1;
 	    continue;
 	}
-	if (pm->gsu.h != &gdbm_hash_gsu) {
+	if (pm->gsu.h != &gdbm_hash_gsu && !TIED_ARRAY(pm)) {
 	    zwarnnam(nam, "not a tied gdbm hash: %s", pmname);
 	    ret = 1;
 	    continue;
 	}
 
 	queue_signals();
-	if (OPT_ISSET(ops,'u'))
-	    gdbmuntie(pm);	/* clear read-only-ness */
+	if (OPT_ISSET(ops,'u')) {
+	    /* clear read-only-ness */
+	    if (TIED_ARRAY(pm))
+	        arr_untie(pm);
+	    else
+	        gdbmuntie(pm);
+	}
 	if (unsetparam_pm(pm, 0, 1)) {
 	    /* assume already reported */
 	    ret = 1;
@@ -248,14 +1973,14 @@ bin_zgdbmpath(char *nam, char **args, Options ops, UNUSED(int func))
         return 1;
     }
 
-    if (pm->gsu.h != &gdbm_hash_gsu) {
+    if (!tied_ext(pm)) {
         zwarnnam(nam, "not a tied gdbm parameter: %s", pmname);
         return 1;
     }
 
     /* Paranoia, it *will* be always set */
-    if (((struct gsu_scalar_ext *)pm->u.hash->tmpdata)->dbfile_path) {
-        setsparam("REPLY", ztrdup(((struct gsu_scalar_ext *)pm->u.hash->tmpdata)->dbfile_path));
+    if (tied_ext(pm)->dbfile_path) {
+        setsparam("REPLY", ztrdup(tied_ext(pm)->dbfile_path));
     } else {
         setsparam("REPLY", ztrdup(""));
     }
@@ -299,410 +2024,4987 @@ bin_zgdbmclear(char *nam, char **args, Options ops, UNUSED(int func))
     return 0;
 }
 
-/*
- * The param is actual param in hash – always, because
- * getgdbmnode creates every new key seen. However, it
- * might be not PM_UPTODATE - which means that database
- * wasn't yet queried.
- *
- * It will be left in this state if database doesn't
- * contain such key. That might be a drawback, maybe
- * setting to empty value has sense, as no other writer
- * can exist. This would remove subtle hcalloc(1) leak.
- */
-
 /**/
-static char *
-gdbmgetfn(Param pm)
+static int
+bin_zgdbmbloom(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
 {
-    datum key, content;
-    int ret;
-    GDBM_FILE dbf;
+    Param pm;
+    struct gsu_scalar_ext *gsu_ext;
+    char *pmname;
 
-    /* Key already retrieved? There is no sense of asking the
-     * database again, because:
-     * - there can be only multiple readers
-     * - so, no writer + reader use is allowed
-     *
-     * Thus:
-     * - if we are writers, we for sure have newest copy of data
-     * - if we are readers, we for sure have newest copy of data
-     */
-    if ( pm->node.flags & PM_UPTODATE ) {
-        return pm->u.str ? pm->u.str : (char *) hcalloc(1);
+    pmname = *args;
+
+    pm = (Param) paramtab->getnode(paramtab, pmname);
+    if(!pm) {
+        zwarnnam(nam, "no such parameter: %s", pmname);
+        return 1;
     }
 
-    /* Unmetafy key. GDBM fits nice into this
-     * process, as it uses length of data */
-    int umlen = 0;
-    char *umkey = unmetafy_zalloc(pm->node.nam,&umlen);
+    if (pm->gsu.h != &gdbm_hash_gsu) {
+        zwarnnam(nam, "not a tied gdbm parameter: %s", pmname);
+        return 1;
+    }
 
-    key.dptr = umkey;
-    key.dsize = umlen;
+    /* Rebuild from keys in the database, e.g. after it
+     * was modified without the filter, and write it out */
+    gsu_ext = (struct gsu_scalar_ext *)pm->u.hash->tmpdata;
+    if (tie_ensure(gsu_ext) || bloom_build(gsu_ext) || bloom_save(gsu_ext)) {
+        zwarnnam(nam, "cannot build bloom filter for %s", pmname);
+        return 1;
+    }
 
-    dbf = ((struct gsu_scalar_ext *)pm->gsu.s)->dbf;
+    return 0;
+}
 
-    if((ret = gdbm_exists(dbf, key))) {
-        /* We have data – store it, return it */
-        pm->node.flags |= PM_UPTODATE;
+/*
+ * Writes snapshot of the database for ztie -s readers.
+ */
 
-        content = gdbm_fetch(dbf, key);
+/**/
+static int
+bin_zgdbmsnapshot(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    Param pm;
+    struct gsu_scalar_ext *gsu_ext;
+    char *pmname;
 
-        /* Ensure there's no leak */
-        if (pm->u.str) {
-            zsfree(pm->u.str);
-        }
+    pmname = *args;
 
-        /* Metafy returned data. All fits - metafy
-         * can obtain data length to avoid using \0 */
-        pm->u.str = metafy(content.dptr, content.dsize, META_DUP);
+    pm = (Param) paramtab->getnode(paramtab, pmname);
+    if(!pm) {
+        zwarnnam(nam, "no such parameter: %s", pmname);
+        return 1;
+    }
 
-        /* Free key, restoring its original length */
-        set_length(umkey, umlen);
-        zsfree(umkey);
+    if (pm->gsu.h != &gdbm_hash_gsu) {
+        zwarnnam(nam, "not a tied gdbm parameter: %s", pmname);
+        return 1;
+    }
 
-        /* Can return pointer, correctly saved inside hash */
-        return pm->u.str;
+    gsu_ext = (struct gsu_scalar_ext *)pm->u.hash->tmpdata;
+    if (tie_ensure(gsu_ext)) {
+        zwarnnam(nam, "no database to take snapshot of: %s", pmname);
+        return 1;
     }
 
-    /* Free key, restoring its original length */
-    set_length(umkey, umlen);
-    zsfree(umkey);
+    if (snap_write(gsu_ext, unmeta(dyncat(gsu_ext->dbfile_path, ".snap")))) {
+        zwarnnam(nam, "cannot write snapshot of %s: %e", pmname, errno);
+        return 1;
+    }
 
-    /* Can this be "" ? */
-    return (char *) hcalloc(1);
+    return 0;
 }
 
+/*
+ * Array value of a key: `zgdbmarray name key` sets $reply
+ * to the elements, with an index $REPLY to one of them,
+ * -n sets $REPLY to their number. -s stores the array
+ * given after the key, -a appends to it. A value stored
+ * as plain string is an array of its null-separated
+ * parts, as (0) would split it.
+ */
+
 /**/
-static void
-gdbmsetfn(Param pm, char *val)
+static int
+bin_zgdbmarray(char *nam, char **args, Options ops, UNUSED(int func))
 {
-    datum key, content;
-    GDBM_FILE dbf;
+    Param pm;
+    HashNode hn;
+    struct gsu_scalar_ext *gsu_ext;
+    char *pmname = args[0], *umkey, **reply;
+    datum key, content, elem, stored;
+    int klen, off, flags = 0, found, count, i;
 
-    /* Set is done on parameter and on database.
-     * See the allowed workers / readers comment
-     * at gdbmgetfn() */
+    pm = (Param) paramtab->getnode(paramtab, pmname);
+    if(!pm) {
+        zwarnnam(nam, "no such parameter: %s", pmname);
+        return 1;
+    }
 
-    /* Parameter */
-    if (pm->u.str) {
-        zsfree(pm->u.str);
-        pm->u.str = NULL;
-        pm->node.flags &= ~(PM_UPTODATE);
+    if (pm->gsu.h != &gdbm_hash_gsu) {
+        zwarnnam(nam, "not a tied gdbm parameter: %s", pmname);
+        return 1;
     }
 
-    if (val) {
-        pm->u.str = ztrdup(val);
-        pm->node.flags |= PM_UPTODATE;
+    if ((OPT_ISSET(ops,'s') || OPT_ISSET(ops,'a')) && (pm->node.flags & PM_READONLY)) {
+        zwarnnam(nam, "read-only variable: %s", pmname);
+        return 1;
     }
 
-    /* Database */
-    dbf = ((struct gsu_scalar_ext *)pm->gsu.s)->dbf;
-    if (dbf) {
-        int umlen = 0;
-        char *umkey = unmetafy_zalloc(pm->node.nam,&umlen);
+    gsu_ext = (struct gsu_scalar_ext *)pm->u.hash->tmpdata;
+    if (tie_ensure(gsu_ext)) {
+        zwarnnam(nam, "database of %s is closed", pmname);
+        return 1;
+    }
 
-        key.dptr = umkey;
-        key.dsize = umlen;
+    umkey = dupstring(args[1]);
+    unmetafy(umkey, &klen);
+    key.dptr = umkey;
+    key.dsize = klen;
+    args += 2;
 
-        if (val) {
-            /* Unmetafy with exact zalloc size */
-            char *umval = unmetafy_zalloc(val,&umlen);
+    if (OPT_ISSET(ops,'s')) {
+        rec_array_pack(args, &content);
+    } else {
+        found = !tie_fetch(gsu_ext, key, &content);
+        if (found && rec_decode(gsu_ext, content, &content, &flags)) {
+            zwarnnam(nam, "cannot decode value of %s in %s", args[-1], gsu_ext->dbfile_path);
+            return 1;
+        }
+        if (!found) {
+            content.dptr = NULL;
+            content.dsize = 0;
+        } else if (!(flags & REC_ARRAY)) {
+            /* Plain string, packed from its parts */
+            char *p, *end = content.dptr + content.dsize, *part, **parts;
+
+            for (count = content.dsize ? 1 : 0, p = content.dptr; p < end; p++)
+                count += !*p;
+            parts = (char **) zhalloc((count + 1) * sizeof(char *));
+            for (i = 0, part = p = content.dptr; i < count; p++) {
+                if (p == end || !*p) {
+                    parts[i++] = metafy(part, p - part, META_HEAPDUP);
+                    part = p + 1;
+                }
+            }
+            parts[count] = NULL;
+            rec_array_pack(parts, &content);
+        }
 
-            /* Store */
-            content.dptr = umval;
-            content.dsize = umlen;
-            (void)gdbm_store(dbf, key, content, GDBM_REPLACE);
+        if (OPT_ISSET(ops,'a')) {
+            /* Packed elements are only added to the end */
+            datum more;
+            char *joined;
+
+            rec_array_pack(args, &more);
+            joined = (char *) zhalloc(content.dsize + more.dsize + 1);
+            if (content.dsize)
+                memcpy(joined, content.dptr, content.dsize);
+            memcpy(joined + content.dsize, more.dptr, more.dsize);
+            content.dptr = joined;
+            content.dsize += more.dsize;
+        } else {
+            if (OPT_ISSET(ops,'n')) {
+                for (off = count = 0; !rec_array_next(content, &off, &elem); count++)
+                    ;
+                setiparam("REPLY", count);
+                return 0;
+            }
+            if (*args) {
+                /* One element, negative index counts from the end */
+                zlong idx = zstrtol(*args, NULL, 10);
+
+                if (idx < 0) {
+                    for (off = count = 0; !rec_array_next(content, &off, &elem); count++)
+                        ;
+                    idx += count + 1;
+                }
+                for (off = 0, i = 1; !rec_array_next(content, &off, &elem); i++) {
+                    if (i == idx) {
+                        setsparam("REPLY", metafy(elem.dptr, elem.dsize, META_DUP));
+                        return 0;
+                    }
+                }
+                setsparam("REPLY", ztrdup(""));
+                return 1;
+            }
+
+            for (off = count = 0; !rec_array_next(content, &off, &elem); count++)
+                ;
+            reply = (char **) zshcalloc((count + 1) * sizeof(char *));
+            for (off = i = 0; !rec_array_next(content, &off, &elem); i++)
+                reply[i] = metafy(elem.dptr, elem.dsize, META_DUP);
+            setaparam("reply", reply);
+            return !found;
+        }
+    }
 
-            /* Free */
-            set_length(umval, umlen);
-            zsfree(umval);
+    rec_encode(gsu_ext, content, REC_ARRAY, 0, &stored);
+    if (tie_store(gsu_ext, key, stored, 1)) {
+        zwarnnam(nam, "cannot store %s in %s", args[-1], gsu_ext->dbfile_path);
+        return 1;
+    }
+    chlog_note(gsu_ext, args[-1]);
+    bloom_add(gsu_ext, key.dptr, key.dsize);
+
+    /* Seen through the hash as joined elements, fetched again */
+    if ((hn = gethashnode2(pm->u.hash, args[-1]))) {
+        ((Param) hn)->node.flags &= ~PM_UPTODATE;
+    }
+    return 0;
+}
+
+/*
+ * Adds delta (an integer, 1 without it) to
+ * the number stored under the key, missing key counting
+ * as 0, and sets $REPLY to the result. The lock is held
+ * from the fetch to the store, so increments of other
+ * shells sharing the database (-o shared=1) aren't lost.
+ * A number is stored in decimal, with -b or when it's
+ * been stored so before, as a binary record.
+ */
+
+/**/
+static int
+bin_zgdbmincr(char *nam, char **args, Options ops, UNUSED(int func))
+{
+    Param pm;
+    HashNode hn;
+    struct gsu_scalar_ext *gsu_ext;
+    char *pmname = args[0], *umkey, *str, *end;
+    datum key, content, stored;
+    zlong delta = 1, val = 0;
+    int klen, flags = 0, binary = OPT_ISSET(ops,'b'), ret;
+
+    pm = (Param) paramtab->getnode(paramtab, pmname);
+    if(!pm) {
+        zwarnnam(nam, "no such parameter: %s", pmname);
+        return 1;
+    }
+
+    if (pm->gsu.h != &gdbm_hash_gsu) {
+        zwarnnam(nam, "not a tied gdbm parameter: %s", pmname);
+        return 1;
+    }
+
+    if (pm->node.flags & PM_READONLY) {
+        zwarnnam(nam, "read-only variable: %s", pmname);
+        return 1;
+    }
+
+    if (args[2]) {
+        delta = zstrtol(args[2], &end, 10);
+        if (end == args[2] || *end) {
+            zwarnnam(nam, "bad delta: %s", args[2]);
+            return 1;
+        }
+    }
+
+    gsu_ext = (struct gsu_scalar_ext *)pm->u.hash->tmpdata;
+    if (tie_ensure(gsu_ext)) {
+        zwarnnam(nam, "database of %s is closed", pmname);
+        return 1;
+    }
+
+    umkey = dupstring(args[1]);
+    unmetafy(umkey, &klen);
+    key.dptr = umkey;
+    key.dsize = klen;
+
+    if (tie_hold(gsu_ext, 1)) {
+        zwarnnam(nam, "cannot lock %s (%e)", gsu_ext->dbfile_path, errno);
+        return 1;
+    }
+
+    if (!tie_fetch(gsu_ext, key, &content)) {
+        if (rec_decode(gsu_ext, content, &content, &flags) || (flags & REC_ARRAY) ||
+            ((flags & REC_INT) && content.dsize != sizeof(val))) {
+            zwarnnam(nam, "value of %s isn't a number", args[1]);
+            tie_hold(gsu_ext, 0);
+            return 1;
+        }
+        if (flags & REC_INT) {
+            memcpy(&val, content.dptr, sizeof(val));
+            binary = 1;
         } else {
-            (void)gdbm_delete(dbf, key);
+            str = (char *) zhalloc(content.dsize + 1);
+            memcpy(str, content.dptr, content.dsize);
+            str[content.dsize] = '\0';
+            val = zstrtol(str, &end, 10);
+            while (inblank(*end))
+                end++;
+            if (*end || (int) strlen(str) != content.dsize) {
+                zwarnnam(nam, "value of %s isn't a number", args[1]);
+                tie_hold(gsu_ext, 0);
+                return 1;
+            }
         }
+    }
+    val += delta;
 
-        /* Free key */
-        set_length(umkey, key.dsize);
-        zsfree(umkey);
+    if (binary) {
+        content.dptr = (char *) &val;
+        content.dsize = sizeof(val);
+        rec_encode(gsu_ext, content, REC_INT, 0, &stored);
+    } else {
+        content.dptr = (char *) zhalloc(DIGBUFSIZE);
+        convbase(content.dptr, val, 10);
+        content.dsize = strlen(content.dptr);
+        rec_encode(gsu_ext, content, 0, 0, &stored);
+    }
+    ret = tie_store(gsu_ext, key, stored, 1);
+    tie_hold(gsu_ext, 0);
+    if (ret) {
+        zwarnnam(nam, "cannot store %s in %s", args[1], gsu_ext->dbfile_path);
+        return 1;
+    }
+    chlog_note(gsu_ext, args[1]);
+    bloom_add(gsu_ext, key.dptr, key.dsize);
+
+    if ((hn = gethashnode2(pm->u.hash, args[1]))) {
+        ((Param) hn)->node.flags &= ~PM_UPTODATE;
+    }
+    setiparam("REPLY", val);
+    return 0;
+}
+
+/*
+ * Tracing of operations on all ties, into a ring of the
+ * last N (4096 by default):
+ *
+ *   zgdbmtrace on [N]     start, dropping entries traced before
+ *   zgdbmtrace off        stop
+ *   zgdbmtrace clear      drop entries traced so far
+ *   zgdbmtrace dump [file]
+ *                         write entries, oldest first, one per line:
+ *                         start time (seconds since the epoch, with
+ *                         microseconds), operation, key hash, size,
+ *                         duration in microseconds; with -b, binary:
+ *                         struct trace_header and the entries
+ *   zgdbmtrace hash key   set $REPLY to hash of the key, as dumped
+ */
+
+/**/
+static int
+bin_zgdbmtrace(char *nam, char **args, Options ops, UNUSED(int func))
+{
+    char *cmd = args[0], *end;
+
+    if (!strcmp(cmd, "on")) {
+        zlong size = TRACE_SIZE;
+
+        if (args[1]) {
+            size = zstrtol(args[1], &end, 10);
+            if (end == args[1] || *end || size < 1) {
+                zwarnnam(nam, "bad number of entries: %s", args[1]);
+                return 1;
+            }
+        }
+        trace_stop();
+        trace_ring = (struct trace_ent *) zshcalloc(size * sizeof(struct trace_ent));
+        trace_size = size;
+    } else if (!strcmp(cmd, "off")) {
+        trace_stop();
+    } else if (!strcmp(cmd, "clear")) {
+        trace_count = 0;
+    } else if (!strcmp(cmd, "hash")) {
+        char buf[2 * sizeof(zulong) + 1], *umkey;
+        int len;
+
+        if (!args[1]) {
+            zwarnnam(nam, "key expected");
+            return 1;
+        }
+        umkey = dupstring(args[1]);
+        unmetafy(umkey, &len);
+        sprintf(buf, "%0*llx", (int) (2 * sizeof(zulong)),
+                (unsigned long long) keyhash(umkey, len));
+        setsparam("REPLY", ztrdup(buf));
+    } else if (!strcmp(cmd, "dump")) {
+        struct trace_header hdr;
+        struct trace_ent *ent;
+        zulong i, first;
+        FILE *out = stdout;
+        int err = 0;
+
+        if (!trace_ring) {
+            zwarnnam(nam, "tracing is off");
+            return 1;
+        }
+        if (args[1] && !(out = fopen(unmeta(args[1]), OPT_ISSET(ops,'b') ? "wb" : "w"))) {
+            zwarnnam(nam, "cannot write %s: %e", args[1], errno);
+            return 1;
+        }
+
+        first = trace_count > trace_size ? trace_count - trace_size : 0;
+        if (OPT_ISSET(ops,'b')) {
+            memset(&hdr, 0, sizeof(hdr));
+            memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+            hdr.nents = trace_count - first;
+            hdr.entsize = sizeof(struct trace_ent);
+            err = fwrite(&hdr, sizeof(hdr), 1, out) != 1;
+        }
+        for (i = first; i < trace_count && !err; i++) {
+            ent = &trace_ring[i % trace_size];
+            if (OPT_ISSET(ops,'b'))
+                err = fwrite(ent, sizeof(*ent), 1, out) != 1;
+            else
+                err = fprintf(out, "%lld.%06lld %s %0*llx %llu %lld\n",
+                              (long long) (ent->start / 1000000),
+                              (long long) (ent->start % 1000000),
+                              trace_ops[ent->op], (int) (2 * sizeof(zulong)),
+                              (unsigned long long) ent->hash,
+                              (unsigned long long) ent->size,
+                              (long long) ent->dur) < 0;
+        }
+        if (out == stdout)
+            err |= fflush(out) != 0;
+        else
+            err |= fclose(out) != 0;
+        if (err) {
+            zwarnnam(nam, "cannot write trace: %e", errno);
+            return 1;
+        }
+    } else {
+        zwarnnam(nam, "unknown subcommand: %s", cmd);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Sets the value under the key to expire in given number
+ * of seconds, with 0 never. Without the number, sets
+ * $REPLY to seconds the value has left, -1 if it doesn't
+ * expire. Returns 1 when there's no such key.
+ */
+
+/**/
+static int
+bin_zgdbmexpire(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    Param pm;
+    HashNode hn;
+    struct gsu_scalar_ext *gsu_ext;
+    char *pmname = args[0], *umkey, *end;
+    datum key, content, stored;
+    zlong secs = 0, when;
+    int klen, flags, ret;
+
+    pm = (Param) paramtab->getnode(paramtab, pmname);
+    if(!pm) {
+        zwarnnam(nam, "no such parameter: %s", pmname);
+        return 1;
+    }
+
+    if (pm->gsu.h != &gdbm_hash_gsu) {
+        zwarnnam(nam, "not a tied gdbm parameter: %s", pmname);
+        return 1;
+    }
+
+    if (args[2]) {
+        if (pm->node.flags & PM_READONLY) {
+            zwarnnam(nam, "read-only variable: %s", pmname);
+            return 1;
+        }
+        secs = zstrtol(args[2], &end, 10);
+        if (end == args[2] || *end || secs < 0) {
+            zwarnnam(nam, "bad number of seconds: %s", args[2]);
+            return 1;
+        }
+    }
+
+    gsu_ext = (struct gsu_scalar_ext *)pm->u.hash->tmpdata;
+    if (tie_ensure(gsu_ext)) {
+        zwarnnam(nam, "database of %s is closed", pmname);
+        return 1;
+    }
+
+    umkey = dupstring(args[1]);
+    unmetafy(umkey, &klen);
+    key.dptr = umkey;
+    key.dsize = klen;
+
+    if (!args[2]) {
+        if (tie_fetch(gsu_ext, key, &content))
+            return 1;
+        when = rec_expiry(content);
+        setiparam("REPLY", when ? when - (zlong) time(NULL) : -1);
+        return 0;
+    }
+
+    if (tie_hold(gsu_ext, 1)) {
+        zwarnnam(nam, "cannot lock %s (%e)", gsu_ext->dbfile_path, errno);
+        return 1;
+    }
+    if (tie_fetch(gsu_ext, key, &content)) {
+        tie_hold(gsu_ext, 0);
+        return 1;
+    }
+    if (rec_decode(gsu_ext, content, &content, &flags)) {
+        zwarnnam(nam, "cannot decode value of %s in %s", args[1], gsu_ext->dbfile_path);
+        tie_hold(gsu_ext, 0);
+        return 1;
+    }
+    rec_encode(gsu_ext, content, flags & (REC_ARRAY | REC_INT),
+               secs ? (zlong) time(NULL) + secs : -1, &stored);
+    ret = tie_store(gsu_ext, key, stored, 1);
+    tie_hold(gsu_ext, 0);
+    if (ret) {
+        zwarnnam(nam, "cannot store %s in %s", args[1], gsu_ext->dbfile_path);
+        return 1;
+    }
+    if (secs && !gsu_ext->sweep)
+        gsu_ext->sweep = (struct zgdbm_sweep *) zshcalloc(sizeof(struct zgdbm_sweep));
+    chlog_note(gsu_ext, args[1]);
+
+    if ((hn = gethashnode2(pm->u.hash, args[1]))) {
+        ((Param) hn)->node.flags &= ~PM_UPTODATE;
+    }
+    return 0;
+}
+
+/*
+ * zgdbmslice NAME START [END]: sets `reply` to elements
+ * START to END of tied array NAME, indexed as in zsh.
+ * Without the array read, only they are fetched.
+ */
+
+/**/
+static int
+bin_zgdbmslice(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    struct gsu_scalar_ext *gsu_ext;
+    struct zgdbm_arr *arr;
+    zlong ind[2], len, n, i;
+    char **reply, *end;
+    Param pm;
+
+    pm = (Param) paramtab->getnode(paramtab, args[0]);
+    if (!pm) {
+        zwarnnam(nam, "no such parameter: %s", args[0]);
+        return 1;
+    }
+    if (!TIED_ARRAY(pm)) {
+        zwarnnam(nam, "not a tied gdbm array: %s", args[0]);
+        return 1;
+    }
+    for (i = 0; i < 2; i++) {
+        char *arg = args[1 + (i && args[2])];
+
+        ind[i] = zstrtol(arg, &end, 10);
+        if (*end || end == arg) {
+            zwarnnam(nam, "bad index: %s", arg);
+            return 1;
+        }
+    }
+
+    arr = (struct zgdbm_arr *) pm->gsu.a;
+    gsu_ext = arr->tie;
+    if (tie_hold(gsu_ext, 1)) {
+        zwarnnam(nam, "cannot lock %s (%e)", gsu_ext->dbfile_path, errno);
+        return 1;
+    }
+    len = arr_length(gsu_ext);
+    if (arr->elems && (arr->len != len || arr_logged(arr)))
+        arr_drop(arr);
+    for (i = 0; i < 2; i++) {
+        if (ind[i] < 0)
+            ind[i] += len + 1;
+    }
+    if (ind[0] < 1)
+        ind[0] = 1;
+    if (ind[1] > len)
+        ind[1] = len;
+
+    n = ind[1] >= ind[0] ? ind[1] - ind[0] + 1 : 0;
+    reply = (char **) zalloc((n + 1) * sizeof(char *));
+    pushheap();
+    for (i = 0; i < n; i++) {
+        reply[i] = arr->elems ? ztrdup(arr->elems[ind[0] - 1 + i]) :
+            arr_get(gsu_ext, ind[0] + i);
+        freeheap();
+    }
+    popheap();
+    reply[n] = NULL;
+    tie_hold(gsu_ext, 0);
+
+    setaparam("reply", reply);
+    return 0;
+}
+
+/*
+ * zgdbmpush NAME ELEM...: appends to tied array NAME,
+ * without reading it.
+ */
+
+/**/
+static int
+bin_zgdbmpush(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    struct gsu_scalar_ext *gsu_ext;
+    struct zgdbm_arr *arr;
+    zlong len, n;
+    Param pm;
+    int ret = 0;
+
+    pm = (Param) paramtab->getnode(paramtab, args[0]);
+    if (!pm) {
+        zwarnnam(nam, "no such parameter: %s", args[0]);
+        return 1;
+    }
+    if (!TIED_ARRAY(pm)) {
+        zwarnnam(nam, "not a tied gdbm array: %s", args[0]);
+        return 1;
+    }
+    if (pm->node.flags & PM_READONLY) {
+        zwarnnam(nam, "read-only variable: %s", args[0]);
+        return 1;
+    }
+
+    arr = (struct zgdbm_arr *) pm->gsu.a;
+    gsu_ext = arr->tie;
+    if (tie_hold(gsu_ext, 1)) {
+        zwarnnam(nam, "cannot lock %s (%e)", gsu_ext->dbfile_path, errno);
+        return 1;
+    }
+    len = arr_length(gsu_ext);
+    if (arr->elems && (arr->len != len || arr_logged(arr)))
+        arr_drop(arr);
+    for (n = 0; args[n + 1]; n++) {
+        if (arr_put(gsu_ext, len + n + 1, args[n + 1])) {
+            zwarnnam(nam, "cannot store %s in %s", args[n + 1], gsu_ext->dbfile_path);
+            ret = 1;
+            break;
+        }
+    }
+    if (n && arr_setlength(gsu_ext, len + n)) {
+        zwarnnam(nam, "cannot store length of %s in %s", args[0], gsu_ext->dbfile_path);
+        n = 0;
+        ret = 1;
+    }
+    tie_hold(gsu_ext, 0);
+    if (n)
+        chlog_note(gsu_ext, NULL);
+
+    /* Read elements are kept, with the new ones */
+    if (ret) {
+        arr_drop(arr);
+    } else if (arr->elems) {
+        zlong i;
+
+        arr->elems = (char **) zrealloc(arr->elems, (len + n + 1) * sizeof(char *));
+        for (i = 0; i < n; i++)
+            arr->elems[len + i] = ztrdup(args[i + 1]);
+        arr->elems[len + n] = NULL;
+        arr->len = len + n;
+    }
+    return ret;
+}
+
+/*
+ * Compare-and-swap: stores the new value only when the
+ * key holds the expected one (zgdbmcas dbase key expected
+ * new), or with -n, only when the key is absent
+ * (zgdbmcas -n dbase key new). Either happens in one
+ * locked step. Returns 1 when the value wasn't stored,
+ * 2 on error.
+ */
+
+/**/
+static int
+bin_zgdbmcas(char *nam, char **args, Options ops, UNUSED(int func))
+{
+    Param pm;
+    HashNode hn;
+    struct gsu_scalar_ext *gsu_ext;
+    char *pmname = args[0], *umkey, *umexp = NULL, *umval;
+    datum key, content, stored;
+    int klen, elen = 0, vlen, flags = 0, insert = OPT_ISSET(ops,'n'), ret;
+
+    if (insert ? !!args[3] : !args[3]) {
+        zwarnnam(nam, insert ? "too many arguments" : "not enough arguments");
+        return 2;
+    }
+
+    pm = (Param) paramtab->getnode(paramtab, pmname);
+    if(!pm) {
+        zwarnnam(nam, "no such parameter: %s", pmname);
+        return 2;
+    }
+
+    if (pm->gsu.h != &gdbm_hash_gsu) {
+        zwarnnam(nam, "not a tied gdbm parameter: %s", pmname);
+        return 2;
+    }
+
+    if (pm->node.flags & PM_READONLY) {
+        zwarnnam(nam, "read-only variable: %s", pmname);
+        return 2;
+    }
+
+    gsu_ext = (struct gsu_scalar_ext *)pm->u.hash->tmpdata;
+    if (tie_ensure(gsu_ext)) {
+        zwarnnam(nam, "database of %s is closed", pmname);
+        return 2;
+    }
+
+    umkey = dupstring(args[1]);
+    unmetafy(umkey, &klen);
+    key.dptr = umkey;
+    key.dsize = klen;
+    if (!insert) {
+        umexp = dupstring(args[2]);
+        unmetafy(umexp, &elen);
+    }
+    umval = dupstring(args[insert ? 2 : 3]);
+    unmetafy(umval, &vlen);
+    content.dptr = umval;
+    content.dsize = vlen;
+    rec_encode(gsu_ext, content, 0, 0, &stored);
+
+    if (insert) {
+        /* GDBM_INSERT checks and stores under the one lock,
+         * a value that expired is replaced under the hold */
+        ret = tie_store(gsu_ext, key, stored, 0);
+        if (ret == 1 && gsu_ext->sweep) {
+            if (tie_hold(gsu_ext, 1)) {
+                zwarnnam(nam, "cannot lock %s (%e)", gsu_ext->dbfile_path, errno);
+                return 2;
+            }
+            if (tie_fetch(gsu_ext, key, &content))
+                ret = tie_store(gsu_ext, key, stored, 1);
+            tie_hold(gsu_ext, 0);
+        }
+    } else {
+        if (tie_hold(gsu_ext, 1)) {
+            zwarnnam(nam, "cannot lock %s (%e)", gsu_ext->dbfile_path, errno);
+            return 2;
+        }
+        if (tie_fetch(gsu_ext, key, &content) ||
+            rec_decode(gsu_ext, content, &content, &flags)) {
+            ret = 1;
+        } else {
+            if (flags & (REC_ARRAY | REC_INT))
+                rec_text(&content, flags);
+            if (content.dsize != elen || memcmp(content.dptr, umexp, elen))
+                ret = 1;
+            else
+                ret = tie_store(gsu_ext, key, stored, 1);
+        }
+        tie_hold(gsu_ext, 0);
+    }
+    if (ret < 0) {
+        zwarnnam(nam, "cannot store %s in %s", args[1], gsu_ext->dbfile_path);
+        return 2;
+    }
+    if (ret)
+        return 1;
+    chlog_note(gsu_ext, args[1]);
+    bloom_add(gsu_ext, key.dptr, key.dsize);
+
+    if ((hn = gethashnode2(pm->u.hash, args[1]))) {
+        ((Param) hn)->node.flags &= ~PM_UPTODATE;
     }
+    return 0;
+}
+
+/*
+ * Writes a db/cdb file from key and value pairs given
+ * as arguments, or, without them, read from standard
+ * input as null-terminated strings (print -rN).
+ */
+
+/**/
+static int
+bin_zgdbmcdb(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    struct cdbmake mk;
+    char *file, *path, *key, *val;
+    int klen, vlen, reported = 0;
+
+    file = *args++;
+    path = dupstring(file);
+    unmetafy(path, NULL);
+
+    if (cdbmake_start(&mk, path)) {
+        zwarnnam(nam, "cannot write %s: %e", file, errno);
+        return 1;
+    }
+
+    if (*args) {
+        for (; *args; args += 2) {
+            if (!args[1]) {
+                zwarnnam(nam, "missing value for key %s", *args);
+                mk.err = EINVAL;
+                reported = 1;
+                break;
+            }
+            key = dupstring(args[0]);
+            unmetafy(key, &klen);
+            val = dupstring(args[1]);
+            unmetafy(val, &vlen);
+            cdbmake_add(&mk, key, klen, val, vlen);
+        }
+    } else {
+        FILE *in;
+        size_t ksize = 256, vsize = 256;
+        int fd = dup(0);
+
+        if (fd == -1 || !(in = fdopen(fd, "r"))) {
+            if (fd != -1)
+                close(fd);
+            mk.err = errno;
+        } else {
+            key = (char *) zalloc(ksize);
+            val = (char *) zalloc(vsize);
+            while (!mk.err && (klen = cdbmake_field(in, &key, &ksize)) != -1) {
+                if ((vlen = cdbmake_field(in, &val, &vsize)) == -1) {
+                    zwarnnam(nam, "missing value for key %s",
+                             metafy(key, klen, META_HEAPDUP));
+                    mk.err = EINVAL;
+                    reported = 1;
+                    break;
+                }
+                cdbmake_add(&mk, key, klen, val, vlen);
+            }
+            if (!mk.err && ferror(in))
+                mk.err = errno ? errno : EIO;
+            zfree(key, ksize);
+            zfree(val, vsize);
+            fclose(in);
+        }
+    }
+
+    if (cdbmake_finish(&mk, path)) {
+        if (!reported)
+            zwarnnam(nam, "cannot write %s: %e", file, errno);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Sets $reply to pairs of names and values of
+ * the tie's settings, as they are in effect.
+ */
+
+#define INFO_MAX 64
+
+/**/
+static int
+bin_zgdbminfo(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    Param pm;
+    struct gsu_scalar_ext *gsu_ext;
+    char *pmname, *names, **reply, *info[INFO_MAX];
+    int i, n = 0;
+    struct stat st;
+
+    pmname = *args;
+
+    pm = (Param) paramtab->getnode(paramtab, pmname);
+    if(!pm) {
+        zwarnnam(nam, "no such parameter: %s", pmname);
+        return 1;
+    }
+
+    if (!(gsu_ext = tied_ext(pm))) {
+        zwarnnam(nam, "not a tied gdbm parameter: %s", pmname);
+        return 1;
+    }
+
+    /* State of a lazy tie as it was, before opening it */
+    if (gsu_ext->lazy) {
+        ADDNUMINFO("idle", gsu_ext->opts->val[TOPT_IDLE]);
+        ADDNUMINFO("open", gsu_ext->db != NULL);
+        ADDNUMINFO("opens", gsu_ext->lazy->opens);
+        (void)tie_ensure(gsu_ext);
+    }
+    if (!gsu_ext->db && !gsu_ext->snap) {
+        zwarnnam(nam, "database of %s is closed", pmname);
+        return 1;
+    }
+
+    ADDINFO("path", gsu_ext->dbfile_path);
+    ADDINFO("backend", (char *) gsu_ext->backend->name);
+    if (gsu_ext->snap) {
+        ADDINFO("snapshot", "1");
+        ADDNUMINFO("size", gsu_ext->snap->size);
+        ADDNUMINFO("keys", ((struct snap_header *) gsu_ext->snap->map)->nkeys);
+        goto done;
+    }
+    if (gsu_ext->backend->fd(gsu_ext->db) != -1 &&
+        !fstat(gsu_ext->backend->fd(gsu_ext->db), &st))
+        ADDNUMINFO("size", st.st_size);
+    n = gsu_ext->backend->info(gsu_ext->db, info, n);
+    ADDNUMINFO("waited", gsu_ext->waited);
+    /* Bytes of dropped value and name buffers, to be reused */
+    ADDNUMINFO("arenafree", gsu_ext->freebytes);
+    if (gsu_ext->opts->val[TOPT_COMPRESS] > 0) {
+        ADDNUMINFO("compress", gsu_ext->opts->val[TOPT_COMPRESS]);
+        ADDNUMINFO("compressed", gsu_ext->zcount);
+        /* Stored size of compressed values, percent of their size */
+        ADDNUMINFO("ratio", gsu_ext->zraw ? gsu_ext->zstored * 100 / gsu_ext->zraw : 100);
+    }
+    if (gsu_ext->warm) {
+        ADDNUMINFO("warm", gsu_ext->opts->val[TOPT_WARM]);
+        ADDNUMINFO("warmed", gsu_ext->warm->loaded);
+    }
+    if (gsu_ext->sweep) {
+        ADDNUMINFO("ttl", gsu_ext->opts->val[TOPT_TTL]);
+        ADDNUMINFO("expired", gsu_ext->sweep->expired);
+    }
+    if (gsu_ext->dedup) {
+        ADDNUMINFO("dedup", gsu_ext->dedup->min);
+        ADDNUMINFO("shared", gsu_ext->dedup->shared);
+        ADDNUMINFO("interned", gsu_ext->dedup->count);
+    }
+
+    /* Names of settings chosen by auto mode */
+    names = "";
+    for (i = 0; i < TOPT_COUNT; i++) {
+        if (gsu_ext->tuned & TOPT_BIT(i))
+            names = *names ? zhtricat(names, ",", tieopt_names[i])
+                : dupstring(tieopt_names[i]);
+    }
+    ADDINFO("auto", names);
+
+ done:
+    reply = (char **) zshcalloc((n + 1) * sizeof(char *));
+    for (i = 0; i < n; i++)
+        reply[i] = ztrdup(info[i]);
+    setaparam("reply", reply);
+    return 0;
+}
+
+/*
+ * The param is actual param in hash – always, because
+ * getgdbmnode creates every new key seen. However, it
+ * might be not PM_UPTODATE - which means that database
+ * wasn't yet queried.
+ *
+ * It will be left in this state if database doesn't
+ * contain such key. That might be a drawback, maybe
+ * setting to empty value has sense, as no other writer
+ * can exist. This would remove subtle hcalloc(1) leak.
+ */
+
+/**/
+static char *
+gdbmgetfn(Param pm)
+{
+    zlong start = TRACE_START();
+    char *val = getgdbmvalue(pm);
+    struct zgdbm_warm *warm = ((struct gsu_scalar_ext *)pm->gsu.s)->warm;
+
+    if (warm)
+        warm_note(warm, pm->node.nam);
+
+    if (start)
+        trace_name(TRACE_GET, start, pm->node.nam, ztrlen(val));
+    return val;
+}
+
+/**/
+static char *
+getgdbmvalue(Param pm)
+{
+    datum key, content;
+    struct gsu_scalar_ext *gsu_ext = (struct gsu_scalar_ext *)pm->gsu.s;
+
+    /* Key already retrieved? There is no sense of asking the
+     * database again, because:
+     * - there can be only multiple readers
+     * - so, no writer + reader use is allowed
+     *
+     * Thus:
+     * - if we are writers, we for sure have newest copy of data
+     * - if we are readers, we for sure have newest copy of data
+     *
+     * A lazy tie lets others write while it's closed, its
+     * cache is checked at the reopen. A shared one checks
+     * generation of the database at each access.
+     */
+    if (TIE_CHECKED(gsu_ext))
+        (void)tie_ensure(gsu_ext);
+
+    /* Value that expires is cached until then */
+    if ( pm->node.flags & PM_UPTODATE ) {
+        if (!ELEM_EXPIRES(pm) || ELEM_EXPIRES(pm) > (zlong) time(NULL))
+            return pm->u.str ? pm->u.str : (char *) hcalloc(1);
+        pm->node.flags &= ~PM_UPTODATE;
+    }
+
+    /* Snapshot has metafied values, point to them */
+    if (gsu_ext->snap) {
+        char *val = snap_lookup(gsu_ext->snap, pm->node.nam);
+        if (val) {
+            pm->u.str = val;
+            pm->node.flags |= PM_UPTODATE;
+            return val;
+        }
+        return (char *) hcalloc(1);
+    }
+
+    if (!gsu_ext->db)
+        return (char *) hcalloc(1);
+
+    /* Unmetafy key. GDBM fits nice into this
+     * process, as it uses length of data */
+    int umlen = 0, loaded = 0;
+    char *umkey = unmetafy_zalloc(pm->node.nam,&umlen);
+
+    key.dptr = umkey;
+    key.dsize = umlen;
+
+    /* Such a key can't have been stored by the tie */
+    if (TIE_RESERVED(key)) {
+        set_length(umkey, umlen);
+        zsfree(umkey);
+        return (char *) hcalloc(1);
+    }
+
+    /* Definite miss - don't touch the database */
+  fetch:
+    if (bloom_test(gsu_ext, umkey, umlen) && !tie_fetch(gsu_ext, key, &content)) {
+        int flags;
+
+        /* We have data – store it, return it. One that
+         * expires is cached until its expiry */
+        ELEM_EXPIRES(pm) = rec_expiry(content);
+        pm->node.flags |= PM_UPTODATE;
+
+        if (rec_decode(gsu_ext, content, &content, &flags)) {
+            zwarn("cannot decode value of %s in %s", pm->node.nam, gsu_ext->dbfile_path);
+            content.dsize = 0;
+        } else if (flags & (REC_ARRAY | REC_INT)) {
+            rec_text(&content, flags);
+        }
+
+        /* Metafy returned data. All fits - metafy
+         * can obtain data length to avoid using \0.
+         * The value is kept in the tie's arena,
+         * fetched data belongs to the backend */
+        setcachedvalue(pm, metafy(content.dptr, content.dsize, META_HEAPDUP));
+
+        /* Free key, restoring its original length */
+        set_length(umkey, umlen);
+        zsfree(umkey);
+
+        /* Can return pointer, correctly saved inside hash */
+        return pm->u.str;
+    }
+
+    /* Missing value is made by the loader function, or
+     * another shell does that meanwhile, then it's there */
+    if (gsu_ext->loader && !gsu_ext->loading && !loaded) {
+        zlong expires = 0;
+        char *val;
+
+        loaded = 1;
+        if ((val = tie_load(gsu_ext, pm->node.nam, key, &expires))) {
+            setcachedvalue(pm, val);
+            ELEM_EXPIRES(pm) = expires;
+            pm->node.flags |= PM_UPTODATE;
+            set_length(umkey, umlen);
+            zsfree(umkey);
+            return val;
+        }
+        goto fetch;
+    }
+
+    /* Free key, restoring its original length */
+    set_length(umkey, umlen);
+    zsfree(umkey);
+
+    /* Can this be "" ? */
+    return (char *) hcalloc(1);
+}
+
+/**/
+static void
+gdbmsetfn(Param pm, char *val)
+{
+    datum key, content;
+    struct gsu_scalar_ext *gsu_ext = (struct gsu_scalar_ext *)pm->gsu.s;
+    zlong start = TRACE_START();
+
+    /* Set is done on parameter and on database.
+     * See the allowed workers / readers comment
+     * at gdbmgetfn() */
+    if (TIE_CHECKED(gsu_ext))
+        (void)tie_ensure(gsu_ext);
+
+    /* Not cached either, the assignment fails */
+    if (!gsu_ext->db) {
+        zerr("cannot %s %s, %s isn't open", val ? "store" : "delete",
+             pm->node.nam, gsu_ext->dbfile_path);
+        return;
+    }
+
+    /* Database */
+    int umlen = 0, ret = 0;
+    zlong expires = 0;
+    char *umkey = unmetafy_zalloc(pm->node.nam,&umlen);
+
+    key.dptr = umkey;
+    key.dsize = umlen;
+
+    if (val) {
+        /* Unmetafy with exact zalloc size */
+        char *umval = unmetafy_zalloc(val,&umlen);
+
+        /* Store, possibly compressed */
+        content.dptr = umval;
+        content.dsize = umlen;
+        rec_encode(gsu_ext, content, 0, 0, &content);
+        expires = rec_expiry(content);
+        if (!(ret = tie_store(gsu_ext, key, content, 1)))
+            bloom_add(gsu_ext, key.dptr, key.dsize);
+
+        /* Free */
+        set_length(umval, umlen);
+        zsfree(umval);
+    } else if (tie_delete(gsu_ext, key) < 0) {
+        /* A key that isn't there is no error */
+        ret = -1;
+    }
+
+    /* Free key */
+    set_length(umkey, key.dsize);
+    zsfree(umkey);
+
+    if (ret) {
+        zerr(val ? "cannot store %s in %s" : "cannot delete %s from %s",
+             pm->node.nam, gsu_ext->dbfile_path);
+        return;
+    }
+    chlog_note(gsu_ext, pm->node.nam);
+
+    /* Parameter. Value that expires is cached until then */
+    if (val) {
+        setcachedvalue(pm, val);
+        ELEM_EXPIRES(pm) = expires;
+        pm->node.flags |= PM_UPTODATE;
+    } else {
+        /* Buffer stays, for the next value */
+        pm->node.flags &= ~(PM_UPTODATE);
+    }
+
+    if (start)
+        trace_name(val ? TRACE_SET : TRACE_UNSET, start, pm->node.nam, val ? ztrlen(val) : 0);
+}
+
+/**/
+static void
+gdbmunsetfn(Param pm, UNUSED(int um))
+{
+    /* Set with NULL */
+    gdbmsetfn(pm, NULL);
+}
+
+/**/
+static HashNode
+getgdbmnode(HashTable ht, const char *name)
+{
+    struct gsu_scalar_ext *gsu_ext = (struct gsu_scalar_ext *) ht->tmpdata;
+    HashNode hn;
+    Param val_pm;
+
+    /* Keys written by subshells are fetched again */
+    if (gsu_ext->chlog && gsu_ext->chlog->hdr->seq != gsu_ext->chlog->seen)
+        chlog_apply(ht);
+
+    hn = gethashnode2( ht, name );
+    val_pm = (Param) hn;
+
+    /* Entry for key doesn't exist? Create it now,
+     * it will be interfacing between the database
+     * and Zsh - through special gdbm_gsu. So, any
+     * seen key results in new interfacing parameter.
+     *
+     * Previous code was returning heap arena Param
+     * that wasn't actually added to the hash. It was
+     * plainly name / database-key holder. Here we
+     * add the Param to its hash, it is not PM_UPTODATE.
+     * It will be loaded from database *and filled*
+     * or left in that state if the database doesn't
+     * contain it.
+     *
+     * Memory comes from the tie's own arena, not from
+     * the shell's heaps, so its usage is limited - by
+     * number of distinct keys seen, not by number of
+     * key *uses*.
+     * */
+
+    if ( ! val_pm ) {
+        char *nam;
+
+        /* Node of a removed element, if any, its
+         * buffers are reused when long enough */
+        if ((val_pm = (Param) gsu_ext->freenodes)) {
+            char *str = val_pm->u.str;
+
+            gsu_ext->freenodes = val_pm->node.next;
+            nam = val_pm->node.nam;
+            if (strlen(nam) >= strlen(name)) {
+                strcpy(nam, name);
+            } else {
+                arena_drop(gsu_ext, nam);
+                nam = arena_strdup(gsu_ext, name);
+            }
+            memset(val_pm, 0, sizeof(struct gdbm_elem));
+            val_pm->u.str = str;
+        } else {
+            Heap oldheaps = arena_enter(gsu_ext);
+            val_pm = (Param) hcalloc( sizeof (struct gdbm_elem) );
+            arena_leave(gsu_ext, oldheaps);
+            nam = arena_strdup(gsu_ext, name);
+        }
+        val_pm->node.flags = PM_SCALAR | PM_HASHELEM; /* no PM_UPTODATE */
+        val_pm->gsu.s = (GsuScalar) gsu_ext;
+        ht->addnode( ht, nam, val_pm ); // sets pm->node.nam
+    }
+
+    return (HashNode) val_pm;
+}
+
+/**/
+static void
+scangdbmkeys(HashTable ht, ScanFunc func, int flags)
+{
+    datum key;
+    struct gsu_scalar_ext *gsu_ext = (struct gsu_scalar_ext *)ht->tmpdata;
+    struct zgdbm_snap *snap;
+    zlong start = TRACE_START();
+    zulong nkeys = 0;
+    int ret;
+
+    /* Changes made by others are picked up here and at prompt,
+     * a replaced snapshot stays mapped until the prompt */
+    if (gsu_ext->watch && watch_changed(gsu_ext))
+        tie_refresh(ht);
+    if (TIE_CHECKED(gsu_ext))
+        (void)tie_ensure(gsu_ext);
+    snap = gsu_ext->snap;
+
+    if (snap) {
+        zulong i;
+
+        /* Keys are metafied in the snapshot */
+        for (i = 0; i < snap->nslots; i++) {
+            if (snap->slots[i].off) {
+                func(getgdbmnode(ht, snap->map + snap->slots[i].off), flags);
+                nkeys++;
+            }
+        }
+        if (start)
+            trace_name(TRACE_SCAN, start, gsu_ext->dbfile_path, nkeys);
+        return;
+    }
+
+    if (!gsu_ext->db)
+        return;
+
+    /* Iterate keys adding them to hash, so
+     * we have Param to use in `func` */
+    ret = gsu_ext->backend->firstkey(gsu_ext->db, &key);
+
+    while(!ret) {
+        datum content;
+
+        /* Expired keys aren't there, nor locks of loads
+         * and shared values */
+        if (TIE_RESERVED(key) || (gsu_ext->sweep && tie_fetch(gsu_ext, key, &content))) {
+            ret = gsu_ext->backend->nextkey(gsu_ext->db, &key);
+            continue;
+        }
+
+        /* This returns database-interfacing Param,
+         * it will return u.str or first fetch data
+         * if not PM_UPTODATE (newly created) */
+        char *zkey = metafy(key.dptr, key.dsize, META_DUP);
+        HashNode hn = getgdbmnode(ht, zkey);
+        zsfree( zkey );
+
+	func(hn, flags);
+        nkeys++;
+
+        /* Iterate - no problem as interfacing Param
+         * will do at most only fetches, not stores */
+        ret = gsu_ext->backend->nextkey(gsu_ext->db, &key);
+    }
+
+    if (start)
+        trace_name(TRACE_SCAN, start, gsu_ext->dbfile_path, nkeys);
+
+}
+
+/*
+ * Replace database with new hash
+ */
+
+/**/
+static void
+gdbmhashsetfn(Param pm, HashTable ht)
+{
+    int i, ret = 0;
+    HashNode hn;
+    struct gsu_scalar_ext *gsu_ext;
+    datum key, content;
+    zlong start;
+
+    if (!pm->u.hash || pm->u.hash == ht)
+	return;
+
+    gsu_ext = (struct gsu_scalar_ext *)pm->u.hash->tmpdata;
+    if (tie_ensure(gsu_ext))
+	return;
+    start = TRACE_START();
+
+    queue_signals();
+    (void)gsu_ext->backend->wipe(gsu_ext->db);
+    unqueue_signals();
+    chlog_note(gsu_ext, NULL);
+
+    /* Empty database, empty filter */
+    if (gsu_ext->bloom)
+        (void)bloom_build(gsu_ext);
+
+    if (!ht) {
+        if (start)
+            trace_name(TRACE_HASHSET, start, gsu_ext->dbfile_path, 0);
+	return;
+    }
+
+     /* Put new strings into database, waiting
+      * for their interfacing-Params to be created */
+
+    for (i = 0; i < ht->hsize && !ret; i++)
+	for (hn = ht->nodes[i]; hn && !ret; hn = hn->next) {
+	    struct value v;
+
+	    v.isarr = v.flags = v.start = 0;
+	    v.end = -1;
+	    v.arr = NULL;
+	    v.pm = (Param) hn;
+
+            /* Unmetafy key */
+            int umlen = 0;
+            char *umkey = unmetafy_zalloc(v.pm->node.nam,&umlen);
+
+	    key.dptr = umkey;
+	    key.dsize = umlen;
+
+	    queue_signals();
+
+            /* Unmetafy */
+            char *umval = unmetafy_zalloc(getstrvalue(&v),&umlen);
+
+            /* Store */
+	    content.dptr = umval;
+	    content.dsize = umlen;
+	    rec_encode(gsu_ext, content, 0, 0, &content);
+	    if (!(ret = tie_store(gsu_ext, key, content, 1)))
+                bloom_add(gsu_ext, key.dptr, key.dsize);
+
+            /* Free - unmetafy_zalloc allocates exact required
+             * space, however unmetafied string can have zeros
+             * in content, so we must first fill with non-0 bytes */
+            set_length(umval, umlen);
+            zsfree(umval);
+            set_length(umkey, key.dsize);
+            zsfree(umkey);
+
+	    unqueue_signals();
+
+            /* The assignment fails, with the elements stored so far */
+            if (ret)
+                zerr("cannot store %s in %s", v.pm->node.nam, gsu_ext->dbfile_path);
+	}
+
+    if (start)
+        trace_name(TRACE_HASHSET, start, gsu_ext->dbfile_path, ht->ct);
+}
+
+/**/
+static void
+gdbmuntie(Param pm)
+{
+    HashTable ht = pm->u.hash;
+    struct gsu_scalar_ext *gsu_ext = (struct gsu_scalar_ext *)ht->tmpdata;
+    zlong start = TRACE_START();
+
+    watch_stop(gsu_ext);
+    chlog_close(gsu_ext);
+
+    if (gsu_ext->snap) {
+        /* Values still point to the map, but hash
+         * elements aren't read after untie */
+        snap_close(gsu_ext->snap);
+        gsu_ext->snap = NULL;
+        remove_tied_name(pm->node.nam);
+    }
+
+    if (gsu_ext->loader) {
+        zsfree(gsu_ext->loader);
+        gsu_ext->loader = NULL;
+    }
+
+    if (gsu_ext->warm) {
+        warm_save(gsu_ext);
+        zfree(gsu_ext->warm, sizeof(struct zgdbm_warm));
+        gsu_ext->warm = NULL;
+    }
+
+    if (gsu_ext->sweep) {
+        if (gsu_ext->sweep->key)
+            zfree(gsu_ext->sweep->key, gsu_ext->sweep->klen);
+        zfree(gsu_ext->sweep, sizeof(struct zgdbm_sweep));
+        gsu_ext->sweep = NULL;
+    }
+
+    if (gsu_ext->dedup) {
+        dedup_forget(gsu_ext->dedup);
+        zfree(gsu_ext->dedup, sizeof(struct zgdbm_dedup));
+        gsu_ext->dedup = NULL;
+    }
+
+    if (gsu_ext->lazy) {
+        zfree(gsu_ext->lazy, sizeof(struct zgdbm_lazy));
+        gsu_ext->lazy = NULL;
+        if (!gsu_ext->db) {
+            bloom_free(gsu_ext);
+            remove_tied_name(pm->node.nam);
+        }
+    }
+
+    if (gsu_ext->db) { /* paranoia */
+        int fd = gsu_ext->backend->fd(gsu_ext->db);
+
+        /* Written while the database is still locked,
+         * so no other writer can make the filter stale */
+        if (gsu_ext->bloom && gsu_ext->bloom->dirty)
+            (void)bloom_save(gsu_ext);
+        bloom_free(gsu_ext);
+
+        if (fd != -1)
+            fdtable[fd] = FDT_UNUSED;
+        gsu_ext->backend->close(gsu_ext->db);
+
+        /* Let hash fields know there's no backend */
+        gsu_ext->db = NULL;
+
+        /* Remove from list of tied parameters */
+        remove_tied_name(pm->node.nam);
+    }
+
+    /* for completeness ... createspecialhash() should have an inverse */
+    ht->getnode = ht->getnode2 = gethashnode2;
+    ht->scantab = NULL;
+
+    pm->node.flags &= ~(PM_SPECIAL|PM_READONLY);
+    pm->gsu.h = &stdhash_gsu;
+
+    if (start)
+        trace_name(TRACE_UNTIE, start, gsu_ext->dbfile_path, 0);
+}
+
+/**/
+static void
+gdbmhashunsetfn(Param pm, UNUSED(int exp))
+{
+    gdbmuntie(pm);
+
+    /* Remember custom GSU structure assigned to
+     * u.hash->tmpdata before hash gets deleted */
+    struct gsu_scalar_ext * gsu_ext = pm->u.hash->tmpdata;
+
+    /* Uses normal unsetter. Will delete hashtable,
+     * emptygdbmtable() releases the owned parameters
+     * at once, with the arena. */
+    pm->gsu.h->setfn(pm, NULL);
+
+    /* Don't need custom GSU structure with its
+     * GDBM_FILE pointer anymore */
+    zsfree( gsu_ext->dbfile_path );
+    zfree( gsu_ext->opts, sizeof(struct tieopts));
+    zfree( gsu_ext, sizeof(struct gsu_scalar_ext));
+
+    pm->node.flags |= PM_UNSET;
+}
+
+/*
+ * Key of element `i` of a tied array, in `buf` of
+ * sizeof(zulong) bytes.
+ */
+
+static datum arr_key(char *buf, zulong i) {
+    datum key;
+    int n = 0;
+    zulong rest;
+
+    for (rest = i; rest; rest >>= 8)
+        n++;
+    key.dptr = buf;
+    key.dsize = n;
+    while (n--) {
+        buf[n] = (char) (i & 0xff);
+        i >>= 8;
+    }
+    return key;
+}
+
+/*
+ * Stored length of a tied array, 0 if none.
+ */
+
+static zlong arr_length(struct gsu_scalar_ext *gsu_ext) {
+    datum key, content;
+    zlong len;
+
+    key.dptr = ARR_LENKEY;
+    key.dsize = ARR_LENKEYLEN;
+    if (gsu_ext->backend->fetch(gsu_ext->db, key, &content) ||
+        content.dsize != sizeof(len))
+        return 0;
+    memcpy(&len, content.dptr, sizeof(len));
+    return len;
+}
+
+static int arr_setlength(struct gsu_scalar_ext *gsu_ext, zlong len) {
+    datum key, content;
+
+    key.dptr = ARR_LENKEY;
+    key.dsize = ARR_LENKEYLEN;
+    content.dptr = (char *) &len;
+    content.dsize = sizeof(len);
+    return gsu_ext->backend->store(gsu_ext->db, key, content, 1);
+}
+
+/*
+ * Element `i` of a tied array, from 1, metafied with
+ * zalloc(). One that is missing is empty.
+ */
+
+static char *arr_get(struct gsu_scalar_ext *gsu_ext, zlong i) {
+    char buf[sizeof(zulong)];
+    datum content;
+    int flags;
+
+    if (tie_fetch(gsu_ext, arr_key(buf, i), &content) ||
+        rec_decode(gsu_ext, content, &content, &flags))
+        return ztrdup("");
+    if (flags & (REC_ARRAY | REC_INT))
+        rec_text(&content, flags);
+    return metafy(content.dptr, content.dsize, META_DUP);
+}
+
+static int arr_put(struct gsu_scalar_ext *gsu_ext, zlong i, char *val) {
+    char buf[sizeof(zulong)];
+    datum content;
+    int umlen;
+
+    content.dptr = dupstring(val);
+    unmetafy(content.dptr, &umlen);
+    content.dsize = umlen;
+    rec_encode(gsu_ext, content, 0, 0, &content);
+    return tie_store(gsu_ext, arr_key(buf, i), content, 1);
+}
+
+static void arr_drop(struct zgdbm_arr *arr) {
+    if (arr->elems)
+        freearray(arr->elems);
+    arr->elems = NULL;
+}
+
+/*
+ * Whether subshells wrote the array since last call, in
+ * the shell that tied. The log holds no keys for it.
+ */
+
+static int arr_logged(struct zgdbm_arr *arr) {
+    struct zgdbm_chlog *chlog = arr->tie->chlog;
+
+    if (!chlog || chlog->hdr->seq == chlog->seen || chlog->pid != getpid() ||
+        chlog_lock(chlog, F_WRLCK))
+        return 0;
+    chlog->hdr->used = 0;
+    chlog->hdr->all = 0;
+    chlog->seen = chlog->hdr->seq;
+    (void)chlog_lock(chlog, F_UNLCK);
+    if (arr->tie->backend->reload)
+        arr->tie->backend->reload(arr->tie->db);
+    return 1;
+}
+
+/*
+ * Reads all elements of a tied array, under one hold of
+ * a shared tie. Returns NULL when the lock can't be had.
+ */
+
+static char **arr_load(struct zgdbm_arr *arr) {
+    struct gsu_scalar_ext *gsu_ext = arr->tie;
+    zlong i;
+
+    if (tie_hold(gsu_ext, 1))
+        return NULL;
+    arr->len = arr_length(gsu_ext);
+    arr->elems = (char **) zalloc((arr->len + 1) * sizeof(char *));
+    pushheap();
+    for (i = 0; i < arr->len; i++) {
+        arr->elems[i] = arr_get(gsu_ext, i + 1);
+        freeheap();
+    }
+    popheap();
+    arr->elems[i] = NULL;
+    tie_hold(gsu_ext, 0);
+    return arr->elems;
+}
+
+/*
+ * Ties array `pmname` (ztie -a) to the opened database.
+ */
+
+static int arr_tie(char *nam, char *pmname, int pmflags, const struct zgdbm_backend *engine,
+                   void *db, struct tieopts *opts, char *path, zlong waited) {
+    struct gsu_scalar_ext *gsu_ext;
+    struct zgdbm_arr *arr;
+    Param pm;
+
+    if (!(pm = createparam(pmname, pmflags | PM_SPECIAL | PM_ARRAY))) {
+        zwarnnam(nam, "cannot create the requested parameter %s", pmname);
+        engine->close(db);
+        return 1;
+    }
+    if (pm->old)
+        pm->level = locallevel;
+
+    if (engine->fd(db) != -1)
+        addmodulefd(engine->fd(db), FDT_MODULE);
+    append_tied_name(pmname);
+
+    /* The tie, without the parts of a hash */
+    gsu_ext = (struct gsu_scalar_ext *) zshcalloc(sizeof(struct gsu_scalar_ext));
+    gsu_ext->std = gdbm_gsu_ext.std;
+    gsu_ext->backend = engine;
+    gsu_ext->db = db;
+    gsu_ext->tuned = opts->autoset;
+    gsu_ext->opts = (struct tieopts *) zalloc(sizeof(struct tieopts));
+    *gsu_ext->opts = *opts;
+    gsu_ext->waited = waited;
+    if (*path != '/') {
+        /* Code copied from check_autoload() */
+        path = zhtricat(metafy(zgetcwd(), -1, META_HEAPDUP), "/", path);
+        path = xsymlink(path, 1);
+    }
+    gsu_ext->dbfile_path = ztrdup(path);
+
+    if (!(pmflags & PM_READONLY) && chlog_open(gsu_ext)) {
+        zwarnnam(nam, "cannot share changes of %s with subshells (%e)", pmname, errno);
+    }
+
+    arr = (struct zgdbm_arr *) zshcalloc(sizeof(struct zgdbm_arr));
+    arr->std = gdbm_arr_gsu;
+    arr->tie = gsu_ext;
+    pm->gsu.a = &arr->std;
+    pm->u.arr = NULL;
+    return 0;
+}
+
+/*
+ * Closes the database of a tied array, the elements read
+ * stay as value of the now ordinary array.
+ */
+
+static void arr_untie(Param pm) {
+    struct zgdbm_arr *arr = (struct zgdbm_arr *) pm->gsu.a;
+    struct gsu_scalar_ext *gsu_ext = arr->tie;
+    int fd = gsu_ext->backend->fd(gsu_ext->db);
+    zlong start = TRACE_START();
+
+    if (fd != -1)
+        fdtable[fd] = FDT_UNUSED;
+    gsu_ext->backend->close(gsu_ext->db);
+    chlog_close(gsu_ext);
+    remove_tied_name(pm->node.nam);
+
+    pm->u.arr = arr->elems ? arr->elems : mkarray(NULL);
+    pm->node.flags &= ~(PM_SPECIAL|PM_READONLY);
+    pm->gsu.a = &stdarray_gsu;
+
+    if (start)
+        trace_name(TRACE_UNTIE, start, gsu_ext->dbfile_path, 0);
+    zsfree(gsu_ext->dbfile_path);
+    zfree(gsu_ext->opts, sizeof(struct tieopts));
+    zfree(gsu_ext, sizeof(struct gsu_scalar_ext));
+    zfree(arr, sizeof(struct zgdbm_arr));
+}
+
+/*
+ * The tie of a tied hash or array, NULL for other
+ * parameters.
+ */
+
+static struct gsu_scalar_ext *tied_ext(Param pm) {
+    if (pm->gsu.h == &gdbm_hash_gsu)
+        return (struct gsu_scalar_ext *) pm->u.hash->tmpdata;
+    if (TIED_ARRAY(pm))
+        return ((struct zgdbm_arr *) pm->gsu.a)->tie;
+    return NULL;
+}
+
+/*
+ * Whole value of a tied array, read at first use. Then
+ * the database is asked only with -o shared, for the
+ * length, which others can change at any time.
+ */
+
+/**/
+static char **
+gdbmarrgetfn(Param pm)
+{
+    struct zgdbm_arr *arr = (struct zgdbm_arr *) pm->gsu.a;
+    static char *empty[1];
+
+    if (arr->elems && (TIE_CHECKED(arr->tie) ? arr_length(arr->tie) != arr->len
+                       : arr_logged(arr)))
+        arr_drop(arr);
+    if (!arr->elems && !arr_load(arr))
+        return empty;
+    return arr->elems;
+}
+
+/*
+ * Assignment to a tied array, also of a slice or with
+ * +=, zsh gives the whole new value. Elements equal to
+ * the cached ones aren't written, so appending writes
+ * the new elements and the length.
+ */
+
+/**/
+static void
+gdbmarrsetfn(Param pm, char **val)
+{
+    struct zgdbm_arr *arr = (struct zgdbm_arr *) pm->gsu.a;
+    struct gsu_scalar_ext *gsu_ext = arr->tie;
+    char buf[sizeof(zulong)];
+    zlong len, old, i;
+
+    if (!val)
+        val = mkarray(NULL);
+    if (tie_hold(gsu_ext, 1)) {
+        zwarn("cannot lock %s (%e)", gsu_ext->dbfile_path, errno);
+        freearray(val);
+        return;
+    }
+
+    len = arrlen(val);
+    old = arr_length(gsu_ext);
+    if (arr->elems && (arr->len != old || arr_logged(arr)))
+        arr_drop(arr);
+
+    pushheap();
+    for (i = 0; i < len; i++) {
+        if (!arr->elems || i >= arr->len || strcmp(arr->elems[i], val[i]))
+            (void)arr_put(gsu_ext, i + 1, val[i]);
+        freeheap();
+    }
+    popheap();
+    for (i = len; i < old; i++)
+        (void)tie_delete(gsu_ext, arr_key(buf, i + 1));
+    if (len != old)
+        (void)arr_setlength(gsu_ext, len);
+    tie_hold(gsu_ext, 0);
+    chlog_note(gsu_ext, NULL);
+
+    arr_drop(arr);
+    arr->elems = val;
+    arr->len = len;
+}
+
+/**/
+static void
+gdbmarrunsetfn(Param pm, UNUSED(int exp))
+{
+    arr_untie(pm);
+
+    /* Frees the elements, as of an ordinary array */
+    pm->gsu.a->setfn(pm, NULL);
+    pm->node.flags |= PM_UNSET;
+}
+
+static struct features module_features = {
+    bintab, sizeof(bintab)/sizeof(*bintab),
+    NULL, 0,
+    NULL, 0,
+    patab, sizeof(patab)/sizeof(*patab),
+    0
+};
+
+/**/
+int
+setup_(UNUSED(Module m))
+{
+    return 0;
+}
+
+/**/
+int
+features_(Module m, char ***features)
+{
+    *features = featuresarray(m, &module_features);
+    return 0;
+}
+
+/**/
+int
+enables_(Module m, int **enables)
+{
+    return handlefeatures(m, &module_features, enables);
+}
+
+/**/
+int
+boot_(UNUSED(Module m))
+{
+    zgdbm_tied = zshcalloc((1) * sizeof(char *));
+    addprepromptfn(zgdbm_preprompt);
+    addhookfunc("exit", zgdbm_exithook);
+    return 0;
+}
+
+/**/
+int
+cleanup_(Module m)
+{
+#ifdef ZGDBM_WRITEBEHIND
+    if (wb_forkset) {
+        zwarnnam(m->node.nam, "can't be unloaded after writebehind was used");
+        return 1;
+    }
+#endif
+    delprepromptfn(zgdbm_preprompt);
+    deletehookfunc("exit", zgdbm_exithook);
+    if (idle_when) {
+        deltimedfn(zgdbm_idletimer);
+        idle_when = 0;
+    }
+    trace_stop();
+    /* This frees `zgdbm_tied` */
+    return setfeatureenables(m, &module_features, NULL);
+}
+
+/**/
+int
+finish_(UNUSED(Module m))
+{
+    return 0;
+}
+
+/*********************
+ * Utility functions *
+ *********************/
+
+static Param createhash( char *name, int flags ) {
+    Param pm;
+    HashTable ht;
+
+    pm = createparam(name, flags | PM_SPECIAL | PM_HASHED);
+    if (!pm) {
+        return NULL;
+    }
+
+    if (pm->old)
+	pm->level = locallevel;
+
+    /* This creates standard hash. */
+    ht = pm->u.hash = newparamtable(32, name);
+    if (!pm->u.hash) {
+        paramtab->removenode(paramtab, name);
+        paramtab->freenode(&pm->node);
+        zwarnnam(name, "Out of memory when allocating hash");
+    }
+
+    /* These provide special features */
+    ht->getnode = ht->getnode2 = getgdbmnode;
+    ht->scantab = scangdbmkeys;
+
+    /* Nodes live in the tie's arena, these are
+     * kept also after gdbmuntie() */
+    ht->emptytable = emptygdbmtable;
+    ht->freenode = freegdbmnode;
+
+    return pm;
+}
+
+/*
+ * Makes zhalloc() allocate from the tie's arena,
+ * until arena_leave() is called with the returned
+ * heaps.
+ */
+
+static Heap arena_enter(struct gsu_scalar_ext *gsu_ext) {
+    return switch_heaps(gsu_ext->arena);
+}
+
+/*
+ * Switches back to shell's heaps. A single allocation
+ * adds at most one chunk, so the list is at most two
+ * long - the first chunk is moved to `arena_full`.
+ */
+
+static void arena_leave(struct gsu_scalar_ext *gsu_ext, Heap oldheaps) {
+    Heap h = switch_heaps(oldheaps);
+
+    while (h && h->next) {
+        Heap next = h->next;
+        h->next = gsu_ext->arena_full;
+        gsu_ext->arena_full = h;
+        h = next;
+    }
+
+    gsu_ext->arena = h;
+}
+
+/*
+ * Frees all chunks of the arena. Goes through
+ * new_heaps() so that heap debugging sees paired
+ * new_heaps() / old_heaps() calls.
+ */
+
+static void arena_release(struct gsu_scalar_ext *gsu_ext) {
+    Heap oldheaps;
+
+    if (gsu_ext->arena) {
+        oldheaps = new_heaps();
+        switch_heaps(gsu_ext->arena);
+        old_heaps(oldheaps);
+        gsu_ext->arena = NULL;
+    }
+    if (gsu_ext->arena_full) {
+        oldheaps = new_heaps();
+        switch_heaps(gsu_ext->arena_full);
+        old_heaps(oldheaps);
+        gsu_ext->arena_full = NULL;
+    }
+    memset(gsu_ext->freebufs, 0, sizeof(gsu_ext->freebufs));
+    gsu_ext->freebytes = 0;
+}
+
+/*
+ * Size class of a buffer for string of given length,
+ * ARENA_CLASSES when it's too long to be reused.
+ */
+
+static int arena_class(size_t len) {
+    int c = ARENA_MINCLASS;
+
+    while (c < ARENA_CLASSES && ((size_t) 1 << c) <= len)
+        c++;
+    return c;
+}
+
+/*
+ * Copies string into the arena, into a buffer abandoned
+ * by arena_drop() when one of its size class is there.
+ * The buffer is of the whole class size, so that it can
+ * be dropped into the same class later.
+ */
+
+static char *arena_strdup(struct gsu_scalar_ext *gsu_ext, const char *s) {
+    size_t len = strlen(s);
+    int c = arena_class(len);
+    Heap oldheaps;
+    char *buf;
+
+    if (c < ARENA_CLASSES && (buf = gsu_ext->freebufs[c])) {
+        memcpy(&gsu_ext->freebufs[c], buf, sizeof(char *));
+        gsu_ext->freebytes -= (zulong) 1 << c;
+    } else {
+        oldheaps = arena_enter(gsu_ext);
+        buf = (char *) zhalloc(c < ARENA_CLASSES ? (size_t) 1 << c : len + 1);
+        arena_leave(gsu_ext, oldheaps);
+    }
+    memcpy(buf, s, len + 1);
+    return buf;
+}
+
+/*
+ * Buffer from arena_strdup() is no longer used, it's
+ * kept for reuse. Its current string is no longer than
+ * the one it was made for, so the class isn't larger
+ * than the buffer. The link is kept in the buffer.
+ */
+
+static void arena_drop(struct gsu_scalar_ext *gsu_ext, char *buf) {
+    int c = arena_class(strlen(buf));
+
+    if (c >= ARENA_CLASSES)
+        return;
+    memcpy(buf, &gsu_ext->freebufs[c], sizeof(char *));
+    gsu_ext->freebufs[c] = buf;
+    gsu_ext->freebytes += (zulong) 1 << c;
+}
+
+/*
+ * Sets cached value of hash element. Old buffer, also
+ * of a value found stale, is reused if the value fits,
+ * otherwise the copy is done into the arena, and old
+ * buffer is dropped for arena_strdup() to reuse. With
+ * ztie -o dedup=N, a value of at least N bytes is
+ * interned, and an interned buffer is never reused -
+ * other elements share it. Values of a snapshot are in
+ * its map.
+ */
+
+static void setcachedvalue(Param pm, const char *val) {
+    struct gsu_scalar_ext *gsu_ext = (struct gsu_scalar_ext *) pm->gsu.s;
+    struct zgdbm_dedup *dedup = gsu_ext->dedup;
+    size_t len = strlen(val);
+    char *old = gsu_ext->snap ? NULL : pm->u.str;
+
+    if (old && dedup && dedup_interned(dedup, old))
+        old = NULL;
+
+    if (dedup && len >= (size_t) dedup->min) {
+        pm->u.str = dedup_intern(gsu_ext, val);
+    } else if (old && strlen(old) >= len) {
+        strcpy(old, val);
+        return;
+    } else {
+        pm->u.str = arena_strdup(gsu_ext, val);
+    }
+
+    if (old && old != pm->u.str)
+        arena_drop(gsu_ext, old);
+}
+
+/*
+ * Hash element is removed from the table - its memory
+ * belongs to the arena, it is kept for getgdbmnode() to
+ * reuse, with buffers of its name and value. Elements
+ * added after zuntie aren't the tie's.
+ */
+
+static void freegdbmnode(HashNode hn) {
+    Param pm = (Param) hn;
+    struct gsu_scalar_ext *gsu_ext;
+
+    if (pm->gsu.s->getfn != gdbmgetfn)
+        return;
+    gsu_ext = (struct gsu_scalar_ext *) pm->gsu.s;
+    hn->next = gsu_ext->freenodes;
+    gsu_ext->freenodes = hn;
+}
+
+/*
+ * Called by deleteparamtable() when the tied hash
+ * is unset, also after gdbmuntie(). Doesn't visit
+ * the nodes, drops them all with the arena.
+ */
+
+static void emptygdbmtable(HashTable ht) {
+    memset(ht->nodes, 0, ht->hsize * sizeof(HashNode));
+    ht->ct = 0;
+
+    if (ht->tmpdata) {
+        struct gsu_scalar_ext *gsu_ext = (struct gsu_scalar_ext *) ht->tmpdata;
+
+        /* Interned values and free nodes go with the arena */
+        if (gsu_ext->dedup)
+            dedup_forget(gsu_ext->dedup);
+        gsu_ext->freenodes = NULL;
+        arena_release(gsu_ext);
+    }
+}
+
+/*
+ * Encodes value to be stored, per settings of the tie:
+ * one long enough is compressed if that makes it shorter.
+ * `flags` tell what the value is (REC_ARRAY), a header is
+ * then written also for an uncompressed one. The value
+ * expires at time `expire`, with 0 after ttl of the tie,
+ * if it has one, with -1 never. The record is on the
+ * heap, or it's the value itself.
+ */
+
+static void rec_encode(struct gsu_scalar_ext *gsu_ext, datum in, int flags, zlong expire,
+                       datum *out) {
+    char *rec;
+    int xlen = 0;
+
+    if (!expire && gsu_ext->opts->val[TOPT_TTL] > 0)
+        expire = time(NULL) + gsu_ext->opts->val[TOPT_TTL];
+    if (expire > 0) {
+        flags |= REC_EXPIRE;
+        xlen = sizeof(expire);
+    }
+
+#ifdef ZGDBM_ZLIB
+    zlong level = gsu_ext->opts->val[TOPT_COMPRESS];
+    zlong min = (gsu_ext->opts->set & TOPT_BIT(TOPT_COMPRESSMIN)) ?
+        gsu_ext->opts->val[TOPT_COMPRESSMIN] : REC_COMPRESSMIN;
+
+    if (level > 0 && in.dsize >= min) {
+        unsigned int rawlen = in.dsize;
+        int off = REC_HDRLEN + sizeof(rawlen) + xlen;
+        uLongf zlen = compressBound(in.dsize);
+
+        rec = (char *) zhalloc(off + zlen);
+        if (compress2((Bytef *) rec + off, &zlen, (Bytef *) in.dptr, in.dsize,
+                      (int) level) == Z_OK && off + zlen < (uLongf) in.dsize) {
+            memcpy(rec, REC_MAGIC, REC_MAGICLEN);
+            rec[REC_MAGICLEN] = flags | REC_DEFLATE;
+            memcpy(rec + REC_HDRLEN, &rawlen, sizeof(rawlen));
+            if (xlen)
+                memcpy(rec + REC_HDRLEN + sizeof(rawlen), &expire, xlen);
+            out->dptr = rec;
+            out->dsize = off + zlen;
+
+            gsu_ext->zcount++;
+            gsu_ext->zraw += in.dsize;
+            gsu_ext->zstored += out->dsize;
+            return;
+        }
+    }
+#endif
+    if (!flags && (in.dsize < REC_MAGICLEN || memcmp(in.dptr, REC_MAGIC, REC_MAGICLEN))) {
+        *out = in;
+        return;
+    }
+
+    rec = (char *) zhalloc(REC_HDRLEN + xlen + in.dsize);
+    memcpy(rec, REC_MAGIC, REC_MAGICLEN);
+    rec[REC_MAGICLEN] = flags;
+    if (xlen)
+        memcpy(rec + REC_HDRLEN, &expire, xlen);
+    memcpy(rec + REC_HDRLEN + xlen, in.dptr, in.dsize);
+    out->dptr = rec;
+    out->dsize = REC_HDRLEN + xlen + in.dsize;
+}
+
+/*
+ * Decodes fetched record, to the heap when it's been
+ * compressed, and tells its REC_ flags. Non-zero return
+ * means it can't be decoded.
+ */
+
+static int rec_decode(UNUSED(struct gsu_scalar_ext *gsu_ext), datum in, datum *out, int *flagsp) {
+    unsigned char flags;
+    unsigned int rawlen = 0;
+    int off = REC_HDRLEN;
+
+    *flagsp = 0;
+    if (in.dsize < REC_HDRLEN || memcmp(in.dptr, REC_MAGIC, REC_MAGICLEN)) {
+        *out = in;
+        return 0;
+    }
+    flags = (unsigned char) in.dptr[REC_MAGICLEN];
+    if (flags & ~REC_FLAGS)
+        return 1;
+    *flagsp = flags;
+
+    if (flags & REC_DEFLATE) {
+        if (in.dsize < off + (int) sizeof(rawlen))
+            return 1;
+        memcpy(&rawlen, in.dptr + off, sizeof(rawlen));
+        off += sizeof(rawlen);
+    }
+    if (flags & REC_EXPIRE) {
+        if (in.dsize < off + (int) sizeof(zlong))
+            return 1;
+        off += sizeof(zlong);
+    }
+
+    if (flags & REC_DEFLATE) {
+#ifdef ZGDBM_ZLIB
+        uLongf len;
+        char *raw;
+
+        len = rawlen;
+        raw = (char *) zhalloc(rawlen + 1);
+        if (uncompress((Bytef *) raw, &len, (Bytef *) in.dptr + off, in.dsize - off) != Z_OK ||
+            len != rawlen)
+            return 1;
+        out->dptr = raw;
+        out->dsize = rawlen;
+        return 0;
+#else
+        return 1;
+#endif
+    }
+
+    out->dptr = in.dptr + off;
+    out->dsize = in.dsize - off;
+    return 0;
+}
+
+/*
+ * Time the record expires at, 0 if it doesn't.
+ */
+
+static zlong rec_expiry(datum in) {
+    unsigned char flags;
+    int off = REC_HDRLEN;
+    zlong when;
+
+    if (in.dsize < REC_HDRLEN || memcmp(in.dptr, REC_MAGIC, REC_MAGICLEN))
+        return 0;
+    flags = (unsigned char) in.dptr[REC_MAGICLEN];
+    if (!(flags & REC_EXPIRE))
+        return 0;
+    if (flags & REC_DEFLATE)
+        off += sizeof(unsigned int);
+    if (in.dsize < off + (int) sizeof(when))
+        return 0;
+    memcpy(&when, in.dptr + off, sizeof(when));
+    return when;
+}
+
+/*
+ * Array values (zgdbmarray). The elements, metafied, are
+ * packed on the heap as unmetafied bytes, each preceded by
+ * its size, so one element is found by skipping sizes and
+ * more are appended by adding them to the end.
+ */
+
+static void rec_array_pack(char **elems, datum *out) {
+    unsigned int len;
+    char **ep, *p;
+    int size = 0;
+
+    for (ep = elems; *ep; ep++)
+        size += sizeof(len) + ztrlen(*ep);
+
+    p = out->dptr = (char *) zhalloc(size + 1);
+    out->dsize = size;
+    for (ep = elems; *ep; ep++) {
+        int ulen;
+        char *elem = dupstring(*ep);
+
+        unmetafy(elem, &ulen);
+        len = ulen;
+        memcpy(p, &len, sizeof(len));
+        memcpy(p + sizeof(len), elem, len);
+        p += sizeof(len) + len;
+    }
+}
+
+/* Element at `off` of packed array, `off` is advanced */
+
+static int rec_array_next(datum payload, int *off, datum *elem) {
+    unsigned int len;
+
+    if (*off + (int) sizeof(len) > payload.dsize)
+        return 1;
+    memcpy(&len, payload.dptr + *off, sizeof(len));
+    if (len > (unsigned int) (payload.dsize - *off - sizeof(len)))
+        return 1;
+    elem->dptr = payload.dptr + *off + sizeof(len);
+    elem->dsize = len;
+    *off += sizeof(len) + len;
+    return 0;
+}
+
+/*
+ * Value of other type as a string, as it's seen through
+ * the tied hash. Integer is written in decimal. Packed
+ * array has the elements separated by null bytes, like
+ * ${(pj:\0:)array}, so that (0) splits it back.
+ */
+
+static void rec_text(datum *content, int flags) {
+    datum elem;
+    char *joined, *p;
+    int off = 0;
+
+    if (flags & REC_INT) {
+        zlong val = 0;
+
+        if (content->dsize == sizeof(val))
+            memcpy(&val, content->dptr, sizeof(val));
+        content->dptr = (char *) zhalloc(DIGBUFSIZE);
+        convbase(content->dptr, val, 10);
+        content->dsize = strlen(content->dptr);
+        return;
+    }
+
+    p = joined = (char *) zhalloc(content->dsize + 1);
+    while (!rec_array_next(*content, &off, &elem)) {
+        if (p != joined)
+            *p++ = '\0';
+        memcpy(p, elem.dptr, elem.dsize);
+        p += elem.dsize;
+    }
+    content->dptr = joined;
+    content->dsize = p - joined;
+}
+
+/*
+ * Maps snapshot file and checks its header.
+ */
+
+static struct zgdbm_snap *snap_open(const char *path) {
+#if defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+    struct zgdbm_snap *snap;
+    struct snap_header *hdr;
+    struct stat st;
+    char *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_NOCTTY)) == -1)
+        return NULL;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct snap_header)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == (char *) MAP_FAILED)
+        return NULL;
+
+    hdr = (struct snap_header *) map;
+    if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) ||
+        !hdr->nslots || (hdr->nslots & (hdr->nslots - 1)) ||
+        hdr->slotoff % sizeof(zulong) ||
+        hdr->slotoff > (zulong) st.st_size ||
+        hdr->nslots > ((zulong) st.st_size - hdr->slotoff) / sizeof(struct snap_slot)) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    snap = (struct zgdbm_snap *) zalloc(sizeof(struct zgdbm_snap));
+    snap->map = map;
+    snap->size = st.st_size;
+    snap->nslots = hdr->nslots;
+    snap->slotoff = hdr->slotoff;
+    snap->slots = (struct snap_slot *) (map + hdr->slotoff);
+    snap->old = NULL;
+    return snap;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+static void snap_close(struct zgdbm_snap *snap) {
+#if defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+    if (snap->old)
+        snap_close(snap->old);
+    munmap(snap->map, snap->size);
+    zfree(snap, sizeof(struct zgdbm_snap));
+#endif
+}
+
+/*
+ * Returns value of metafied key, pointing into the map,
+ * or NULL if the snapshot doesn't have such key.
+ */
+
+static char *snap_lookup(struct zgdbm_snap *snap, const char *key) {
+    zulong h = keyhash(key, strlen(key)), mask = snap->nslots - 1, i;
+    struct snap_slot *slot;
+
+    for (i = h & mask;; i = (i + 1) & mask) {
+        slot = &snap->slots[i];
+        if (!slot->off || slot->off >= snap->slotoff)
+            return NULL;
+        if (slot->hash == h && !strcmp(snap->map + slot->off, key))
+            return snap->map + slot->off + strlen(key) + 1;
+    }
+}
+
+/*
+ * Writes all pairs of the database to a temporary file,
+ * then the table of slots, and renames it into place.
+ */
+
+static int snap_write(struct gsu_scalar_ext *gsu_ext, const char *path) {
+    const struct zgdbm_backend *backend = gsu_ext->backend;
+    struct snap_header hdr;
+    struct snap_slot *slots, *hashes = NULL;
+    zulong nkeys = 0, hsize = 0, nslots, off, i;
+    char *tmppath, *mkey, *mval;
+    datum key, content;
+    FILE *out;
+    int err = 0, saved_errno, ret, flags;
+
+    tmppath = bicat(path, ".tmp");
+    if (!(out = fopen(tmppath, "w"))) {
+        saved_errno = errno;
+        zsfree(tmppath);
+        errno = saved_errno;
+        return 1;
+    }
+
+    /* Pairs, remembering hashes and offsets of keys */
+    memset(&hdr, 0, sizeof(hdr));
+    err = fwrite(&hdr, sizeof(hdr), 1, out) != 1;
+    off = sizeof(hdr);
+
+    ret = backend->firstkey(gsu_ext->db, &key);
+    while (!ret && !err) {
+        if (!TIE_RESERVED(key) && !tie_fetch(gsu_ext, key, &content)) {
+            pushheap();
+            mkey = metafy(key.dptr, key.dsize, META_HEAPDUP);
+            if (rec_decode(gsu_ext, content, &content, &flags))
+                content.dsize = 0;
+            else if (flags & (REC_ARRAY | REC_INT))
+                rec_text(&content, flags);
+            mval = metafy(content.dptr, content.dsize, META_HEAPDUP);
+
+            if (nkeys == hsize) {
+                struct snap_slot *newhashes = (struct snap_slot *)
+                    zalloc((hsize ? 2 * hsize : 1024) * sizeof(struct snap_slot));
+                if (hashes) {
+                    memcpy(newhashes, hashes, hsize * sizeof(struct snap_slot));
+                    zfree(hashes, hsize * sizeof(struct snap_slot));
+                }
+                hashes = newhashes;
+                hsize = hsize ? 2 * hsize : 1024;
+            }
+            hashes[nkeys].hash = keyhash(mkey, strlen(mkey));
+            hashes[nkeys++].off = off;
+
+            err = fwrite(mkey, strlen(mkey) + 1, 1, out) != 1 ||
+                fwrite(mval, strlen(mval) + 1, 1, out) != 1;
+            off += strlen(mkey) + strlen(mval) + 2;
+            popheap();
+        }
+
+        ret = backend->nextkey(gsu_ext->db, &key);
+    }
+
+    /* Table of slots, aligned */
+    for (nslots = 16; nslots < 2 * nkeys; nslots <<= 1)
+        ;
+    slots = (struct snap_slot *) zshcalloc(nslots * sizeof(struct snap_slot));
+    for (i = 0; i < nkeys; i++) {
+        zulong j = hashes[i].hash & (nslots - 1);
+        while (slots[j].off)
+            j = (j + 1) & (nslots - 1);
+        slots[j] = hashes[i];
+    }
+    while (!err && off % sizeof(zulong)) {
+        err = putc('\0', out) == EOF;
+        off++;
+    }
+
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.nkeys = nkeys;
+    hdr.nslots = nslots;
+    hdr.slotoff = off;
+    if (!err)
+        err = fwrite(slots, sizeof(struct snap_slot), nslots, out) != nslots ||
+            fseek(out, 0L, SEEK_SET) ||
+            fwrite(&hdr, sizeof(hdr), 1, out) != 1;
+    saved_errno = errno;
+    err = fclose(out) || err;
+
+    zfree(slots, nslots * sizeof(struct snap_slot));
+    if (hashes)
+        zfree(hashes, hsize * sizeof(struct snap_slot));
+
+    if (err || rename(tmppath, path)) {
+        if (!err)
+            saved_errno = errno;
+        unlink(tmppath);
+        zsfree(tmppath);
+        errno = saved_errno;
+        return 1;
+    }
+    zsfree(tmppath);
+    return 0;
+}
+
+/*
+ * Parses `name=value,...' of ztie -o into opts.
+ * Numbers can have k, m or g suffix.
+ */
+
+static int parse_tieopts(char *nam, char *str, struct tieopts *opts) {
+    char *item, *next, *value, *end;
+    int i;
+
+    for (item = dupstring(str); item; item = next) {
+        if ((next = strchr(item, ',')))
+            *next++ = '\0';
+        if (!*item)
+            continue;
+        if (!strcmp(item, "auto")) {
+            opts->autoset |= TOPT_AUTOMASK;
+            continue;
+        }
+        if ((value = strchr(item, '=')))
+            *value++ = '\0';
+        for (i = 0; i < TOPT_COUNT; i++) {
+            if (!strcmp(item, tieopt_names[i]))
+                break;
+        }
+        if (i == TOPT_COUNT) {
+            zwarnnam(nam, "unknown option: %s", item);
+            return 1;
+        }
+        if (!value || !*value) {
+            zwarnnam(nam, "option %s requires a value", item);
+            return 1;
+        }
+        if (!strcmp(value, "auto")) {
+            if (!(TOPT_BIT(i) & TOPT_AUTOMASK)) {
+                zwarnnam(nam, "option %s can't be auto", item);
+                return 1;
+            }
+            opts->autoset |= TOPT_BIT(i);
+            opts->set &= ~TOPT_BIT(i);
+            continue;
+        }
+        opts->val[i] = zstrtol(value, &end, 10);
+        switch (*end) {
+        case 'k': case 'K':
+            opts->val[i] <<= 10;
+            end++;
+            break;
+        case 'm': case 'M':
+            opts->val[i] <<= 20;
+            end++;
+            break;
+        case 'g': case 'G':
+            opts->val[i] <<= 30;
+            end++;
+            break;
+        }
+        if (*end || opts->val[i] < 0) {
+            zwarnnam(nam, "bad value for option %s: %s", item, value);
+            return 1;
+        }
+        opts->set |= TOPT_BIT(i);
+        opts->autoset &= ~TOPT_BIT(i);
+    }
+
+    return 0;
+}
+
+/*
+ * Applies settings of ztie -o to opened database.
+ * Auto mode sizes the bucket cache to a quarter of
+ * buckets the database has, and the memory map to
+ * twice the size of the file, maps being enabled.
+ */
+
+static int tune_gdbm(char *nam, GDBM_FILE dbf, struct tieopts *opts, zulong dbsize) {
+    int i, intval;
+    size_t sizeval;
+
+    if (opts->autoset & TOPT_BIT(TOPT_CACHE)) {
+        zulong buckets;
+
+#ifdef GDBM_GETBUCKETSIZE
+        if (gdbm_setopt(dbf, GDBM_GETBUCKETSIZE, &sizeval, sizeof(sizeval)) || !sizeval)
+#endif
+        {
+            if (gdbm_setopt(dbf, GDBM_GETBLOCKSIZE, &intval, sizeof(intval)) || intval <= 0)
+                intval = 4096;
+            sizeval = intval;
+        }
+        buckets = dbsize / sizeval;
+        opts->val[TOPT_CACHE] = buckets / 4 < TUNE_MIN_CACHE ? TUNE_MIN_CACHE :
+            buckets / 4 > TUNE_MAX_CACHE ? TUNE_MAX_CACHE : buckets / 4;
+        opts->set |= TOPT_BIT(TOPT_CACHE);
+    }
+    if (opts->autoset & TOPT_BIT(TOPT_MMAP)) {
+        opts->val[TOPT_MMAP] = 1;
+        opts->set |= TOPT_BIT(TOPT_MMAP);
+    }
+    if (opts->autoset & TOPT_BIT(TOPT_MAXMAP)) {
+        /* Only grow the library's limit, in whole megabytes */
+        zulong want = ((2 * dbsize) | 0xfffff) + 1;
+
+        if (gdbm_setopt(dbf, GDBM_GETMAXMAPSIZE, &sizeval, sizeof(sizeval)) ||
+            want > sizeval) {
+            opts->val[TOPT_MAXMAP] = want;
+            opts->set |= TOPT_BIT(TOPT_MAXMAP);
+        }
+    }
+
+    for (i = 0; i < TOPT_COUNT; i++) {
+        int ret = 0;
+
+        if (!(opts->set & TOPT_BIT(i)))
+            continue;
+
+        switch (i) {
+        case TOPT_CACHE:
+            sizeval = opts->val[i];
+            ret = gdbm_setopt(dbf, GDBM_SETCACHESIZE, &sizeval, sizeof(sizeval));
+            break;
+        case TOPT_MAXMAP:
+            sizeval = opts->val[i];
+            ret = gdbm_setopt(dbf, GDBM_SETMAXMAPSIZE, &sizeval, sizeof(sizeval));
+            break;
+        case TOPT_MMAP:
+            intval = opts->val[i] != 0;
+            ret = gdbm_setopt(dbf, GDBM_SETMMAP, &intval, sizeof(intval));
+            break;
+        case TOPT_CENTFREE:
+            intval = opts->val[i] != 0;
+            ret = gdbm_setopt(dbf, GDBM_SETCENTFREE, &intval, sizeof(intval));
+            break;
+        case TOPT_COALESCE:
+            intval = opts->val[i] != 0;
+            ret = gdbm_setopt(dbf, GDBM_SETCOALESCEBLKS, &intval, sizeof(intval));
+            break;
+        default:
+            /* blocksize and sync are arguments of gdbm_open(),
+             * writebehind is a queue set up by ztie */
+            break;
+        }
+        if (ret) {
+            zwarnnam(nam, "cannot set option %s (%s)", tieopt_names[i],
+                     gdbm_strerror(gdbm_errno));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * The GDBM engine. Block size and sync mode are
+ * given to gdbm_open(), the rest is tune_gdbm().
+ */
+
+static void *gdbmdb_open(char *nam, char *path, int readonly, struct tieopts *opts) {
+    struct gdbmdb *gdb;
+    GDBM_FILE dbf;
+    int read_write = GDBM_SYNC, block_size = 0;
+    struct stat st;
+    zulong dbsize = 0;
+
+    if (readonly)
+	read_write |= GDBM_READER;
+    else
+	read_write |= GDBM_WRCREAT;
+    if ((opts->set & TOPT_BIT(TOPT_SYNC)) && !opts->val[TOPT_SYNC])
+	read_write &= ~GDBM_SYNC;
+
+    /* Block size only matters when the database is created.
+     * Auto mode uses preferred I/O size of the file system */
+    if (!stat(unmeta(path), &st)) {
+	dbsize = st.st_size;
+	opts->autoset &= ~TOPT_BIT(TOPT_BLOCKSIZE);
+    } else if (opts->autoset & TOPT_BIT(TOPT_BLOCKSIZE)) {
+	char *dir = dupstring(path), *slash = strrchr(dir, '/');
+
+	if (slash)
+	    slash[1] = '\0';
+	else
+	    dir = ".";
+	if (!stat(unmeta(dir), &st) && st.st_blksize >= 512)
+	    block_size = st.st_blksize;
+    }
+    if (opts->set & TOPT_BIT(TOPT_BLOCKSIZE))
+	block_size = opts->val[TOPT_BLOCKSIZE];
+
+    gdb = (struct gdbmdb *) zshcalloc(sizeof(struct gdbmdb));
+    gdb->lockfd = -1;
+    if (opts->val[TOPT_SHARED]) {
+	/* Created under the lock, writers may race for it */
+	char *lockpath = unmeta(dyncat(path, ".lock"));
+
+	if ((gdb->lockfd = open(lockpath, O_RDWR | O_CREAT | O_NOCTTY, 0666)) == -1 &&
+	    (!readonly || (gdb->lockfd = open(lockpath, O_RDONLY | O_NOCTTY)) == -1)) {
+	    zwarnnam(nam, "cannot open lock file %s.lock (%e)", path, errno);
+	    zfree(gdb, sizeof(struct gdbmdb));
+	    return NULL;
+	}
+	if (gdbmdb_lock(gdb, readonly ? F_RDLCK : F_WRLCK)) {
+	    zwarnnam(nam, "cannot lock %s.lock (%e)", path, errno);
+	    close(gdb->lockfd);
+	    zfree(gdb, sizeof(struct gdbmdb));
+	    return NULL;
+	}
+	read_write |= GDBM_NOLOCK;
+    }
+
+    gdbm_errno=0;
+    dbf = gdbm_open(path, block_size, read_write, 0666, 0);
+    if(dbf == NULL) {
+	if (gdb->lockfd != -1) {
+	    gdbmdb_unlock(gdb, 0);
+	    close(gdb->lockfd);
+	}
+	zfree(gdb, sizeof(struct gdbmdb));
+	if (opts->retry && (gdbm_errno == GDBM_CANT_BE_READER ||
+			    gdbm_errno == GDBM_CANT_BE_WRITER)) {
+	    errno = EWOULDBLOCK;
+	    return NULL;
+	}
+	zwarnnam(nam, "error opening database file %s (%s)", path, gdbm_strerror(gdbm_errno));
+	return NULL;
+    }
+    gdb->dbf = dbf;
+
+    if (tune_gdbm(nam, dbf, opts, dbsize)) {
+	if (gdb->lockfd != -1) {
+	    gdbmdb_unlock(gdb, 0);
+	    close(gdb->lockfd);
+	}
+	gdbm_close(dbf);
+	zfree(gdb, sizeof(struct gdbmdb));
+	return NULL;
+    }
+
+    if (gdb->lockfd != -1) {
+	gdb->seen = gdb->gen;
+	gdb->path = ztrdup(path);
+	gdb->flags = read_write;
+	gdb->opts = *opts;
+	gdbmdb_unlock(gdb, 0);
+	addmodulefd(gdb->lockfd, FDT_MODULE);
+    }
+    return gdb;
+}
+
+static void gdbmdb_close(void *db) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+
+    if (gdb->content.dptr)
+        free(gdb->content.dptr);
+    if (gdb->key.dptr)
+        free(gdb->key.dptr);
+    gdbm_close(gdb->dbf);
+    if (gdb->lockfd != -1) {
+        zclose(gdb->lockfd);
+        zsfree(gdb->path);
+    }
+    zfree(gdb, sizeof(struct gdbmdb));
+}
+
+/*
+ * Shared mode (ztie -o shared=1): many processes can have
+ * the database open for writing, with GDBM_NOLOCK, and
+ * each operation is done under fcntl() lock of a sidecar
+ * file (path with ".lock" appended) - shared for reading,
+ * exclusive for a change. The sidecar holds generation
+ * number of the database, incremented by every change.
+ * As GDBM keeps the header and the directory of the file
+ * in memory, a handle finding the generation changed by
+ * another process opens the database again - GDBM has no
+ * call to read them anew.
+ */
+
+static int gdbmdb_lock(struct gdbmdb *gdb, int type) {
+    struct flock lck;
+    zulong gen;
+    GDBM_FILE dbf;
+    zlong start;
+    int fd;
+
+    /* Inside gdbmdb_hold(), already locked exclusively */
+    if (gdb->depth++)
+        return 0;
+
+    memset(&lck, 0, sizeof(lck));
+    lck.l_type = type;
+    lck.l_whence = SEEK_SET;
+    start = TRACE_START();
+    while (fcntl(gdb->lockfd, F_SETLKW, &lck) == -1) {
+        if (errno != EINTR) {
+            gdb->depth = 0;
+            return 1;
+        }
+    }
+    if (start)
+        trace_add(TRACE_LOCK, start, keyhash(gdb->path, strlen(gdb->path)), 0);
+
+    if (pread(gdb->lockfd, &gen, sizeof(gen), 0) != sizeof(gen))
+        gen = 0;
+    /* No handle yet at the lock taken for opening */
+    if (gen != gdb->gen && gdb->dbf) {
+        if (!(dbf = gdbm_open(gdb->path, 0, gdb->flags, 0666, 0))) {
+            gdbmdb_unlock(gdb, 0);
+            return 1;
+        }
+        (void)tune_gdbm("ztie", dbf, &gdb->opts, 0);
+
+        /* New descriptor takes over the old one's place */
+        fd = gdbm_fdesc(gdb->dbf);
+        if (fdtable[fd] == FDT_MODULE) {
+            fdtable[fd] = FDT_UNUSED;
+            addmodulefd(gdbm_fdesc(dbf), FDT_MODULE);
+        }
+        gdbm_close(gdb->dbf);
+        gdb->dbf = dbf;
+    }
+    gdb->gen = gen;
+    return 0;
+}
+
+/* With `changed`, the generation is incremented */
+
+static void gdbmdb_unlock(struct gdbmdb *gdb, int changed) {
+    struct flock lck;
+
+    gdb->dirty |= changed;
+    if (--gdb->depth)
+        return;
+    changed = gdb->dirty;
+    gdb->dirty = 0;
+
+    if (changed) {
+        zulong gen = gdb->gen + 1;
+
+        if (pwrite(gdb->lockfd, &gen, sizeof(gen), 0) == sizeof(gen)) {
+            /* Cached values are still current if only we wrote */
+            if (gdb->seen == gdb->gen)
+                gdb->seen = gen;
+            gdb->gen = gen;
+        }
+    }
+
+    memset(&lck, 0, sizeof(lck));
+    lck.l_type = F_UNLCK;
+    lck.l_whence = SEEK_SET;
+    (void)fcntl(gdb->lockfd, F_SETLK, &lck);
+}
+
+/*
+ * Keeps the shared database locked for writing between
+ * hold 1 and hold 0, so that operations in between are
+ * done at once, as for read-modify-write of a value.
+ */
+
+static int gdbmdb_hold(void *db, int hold) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+
+    if (gdb->lockfd == -1)
+        return 0;
+    if (hold)
+        return gdbmdb_lock(gdb, F_WRLCK);
+    gdbmdb_unlock(gdb, 0);
+    return 0;
+}
+
+/*
+ * Whether other processes changed the shared database
+ * since last call, so that cached values are stale.
+ */
+
+static int gdbmdb_changed(void *db) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+    zulong gen;
+
+    if (gdb->lockfd == -1 ||
+        pread(gdb->lockfd, &gen, sizeof(gen), 0) != sizeof(gen) || gen == gdb->seen)
+        return 0;
+    gdb->seen = gen;
+    return 1;
+}
+
+#define GDBM_LOCK(gdb, type, err) \
+    do { if ((gdb)->lockfd != -1 && gdbmdb_lock((gdb), (type))) return (err); } while (0)
+#define GDBM_UNLOCK(gdb, changed) \
+    do { if ((gdb)->lockfd != -1) gdbmdb_unlock((gdb), (changed)); } while (0)
+
+static int gdbmdb_fetch(void *db, datum key, datum *content) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+
+    if (gdb->content.dptr)
+        free(gdb->content.dptr);
+    gdb->content.dptr = NULL;
+    GDBM_LOCK(gdb, F_RDLCK, 1);
+    gdb->content = gdbm_fetch(gdb->dbf, key);
+    GDBM_UNLOCK(gdb, 0);
+    if (!gdb->content.dptr)
+        return 1;
+
+    *content = gdb->content;
+    return 0;
+}
+
+static int gdbmdb_store(void *db, datum key, datum content, int replace) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+    int ret;
+
+    GDBM_LOCK(gdb, F_WRLCK, -1);
+    ret = gdbm_store(gdb->dbf, key, content, replace ? GDBM_REPLACE : GDBM_INSERT);
+    GDBM_UNLOCK(gdb, !ret);
+    return ret;
+}
+
+static int gdbmdb_delete(void *db, datum key) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+    int ret;
+
+    GDBM_LOCK(gdb, F_WRLCK, -1);
+    if ((ret = gdbm_delete(gdb->dbf, key)))
+        ret = gdbm_errno == GDBM_ITEM_NOT_FOUND ? 1 : -1;
+    GDBM_UNLOCK(gdb, !ret);
+    return ret;
+}
+
+static int gdbmdb_firstkey(void *db, datum *key) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+
+    if (gdb->key.dptr)
+        free(gdb->key.dptr);
+    gdb->key.dptr = NULL;
+    GDBM_LOCK(gdb, F_RDLCK, 1);
+    gdb->key = gdbm_firstkey(gdb->dbf);
+    GDBM_UNLOCK(gdb, 0);
+    *key = gdb->key;
+    return !gdb->key.dptr;
+}
+
+static int gdbmdb_nextkey(void *db, datum *key) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+    datum next;
+
+    if (!key->dptr)
+        return 1;
+    GDBM_LOCK(gdb, F_RDLCK, 1);
+    next = gdbm_nextkey(gdb->dbf, *key);
+    GDBM_UNLOCK(gdb, 0);
+    if (gdb->key.dptr)
+        free(gdb->key.dptr);
+    gdb->key = next;
+    *key = gdb->key;
+    return !gdb->key.dptr;
+}
+
+static zulong gdbmdb_count(void *db) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+    gdbm_count_t count;
+    int ret;
+
+    GDBM_LOCK(gdb, F_RDLCK, 0);
+    ret = gdbm_count(gdb->dbf, &count);
+    GDBM_UNLOCK(gdb, 0);
+    return ret ? 0 : count;
+}
+
+static int gdbmdb_sync(void *db) {
+    return gdbm_sync(((struct gdbmdb *) db)->dbf);
+}
+
+static int gdbmdb_fd(void *db) {
+    return gdbm_fdesc(((struct gdbmdb *) db)->dbf);
+}
+
+/* Deletes all keys, then lets GDBM shrink the file */
+
+static int gdbmdb_wipe(void *db) {
+    struct gdbmdb *gdb = (struct gdbmdb *) db;
+    datum key;
+    int ret;
+
+    GDBM_LOCK(gdb, F_WRLCK, -1);
+    key = gdbm_firstkey(gdb->dbf);
+    while (key.dptr) {
+	(void)gdbm_delete(gdb->dbf, key);
+	free(key.dptr);
+	key = gdbm_firstkey(gdb->dbf);
+    }
+
+    ret = gdbm_reorganize(gdb->dbf);
+    GDBM_UNLOCK(gdb, 1);
+    return ret;
+}
+
+/* Settings of GDBM in effect, for zgdbminfo */
+
+static int gdbmdb_info(void *db, char **info, int n) {
+    GDBM_FILE dbf = ((struct gdbmdb *) db)->dbf;
+    size_t sizeval;
+    int intval;
+
+    if (!gdbm_setopt(dbf, GDBM_GETBLOCKSIZE, &intval, sizeof(intval)))
+        ADDNUMINFO("blocksize", intval);
+    if (!gdbm_setopt(dbf, GDBM_GETCACHESIZE, &sizeval, sizeof(sizeval)))
+        ADDNUMINFO("cache", sizeval);
+    if (!gdbm_setopt(dbf, GDBM_GETMMAP, &intval, sizeof(intval)))
+        ADDNUMINFO("mmap", intval != 0);
+    if (!gdbm_setopt(dbf, GDBM_GETMAXMAPSIZE, &sizeval, sizeof(sizeval)))
+        ADDNUMINFO("maxmap", sizeval);
+    if (!gdbm_setopt(dbf, GDBM_GETCENTFREE, &intval, sizeof(intval)))
+        ADDNUMINFO("centfree", intval != 0);
+    if (!gdbm_setopt(dbf, GDBM_GETCOALESCEBLKS, &intval, sizeof(intval)))
+        ADDNUMINFO("coalesce", intval != 0);
+    if (!gdbm_setopt(dbf, GDBM_GETSYNCMODE, &intval, sizeof(intval)))
+        ADDNUMINFO("sync", intval != 0);
+    if (((struct gdbmdb *) db)->lockfd != -1) {
+        ADDNUMINFO("shared", 1);
+        ADDNUMINFO("generation", ((struct gdbmdb *) db)->gen);
+    }
+
+    return n;
+}
+
+/*
+ * The log engine. Takes fcntl() lock of the first byte of
+ * the file like GDBM does its lock - shared for readers,
+ * exclusive for the writer, and fails at once if it is
+ * held. Forked subshells inherit the descriptor but not
+ * the lock, appends of all of them are done under lock
+ * of the second byte, after records others appended past
+ * `end` are read into the index.
+ */
+
+static int logdb_lock(int fd, int readonly) {
+    struct flock lck;
+
+    memset(&lck, 0, sizeof(lck));
+    lck.l_type = readonly ? F_RDLCK : F_WRLCK;
+    lck.l_whence = SEEK_SET;
+    lck.l_len = 1;
+    return fcntl(fd, F_SETLK, &lck);
+}
+
+static int logdb_applock(struct logdb *ldb, int type) {
+    struct flock lck;
+    int ret;
+
+    memset(&lck, 0, sizeof(lck));
+    lck.l_type = type;
+    lck.l_whence = SEEK_SET;
+    lck.l_start = 1;
+    lck.l_len = 1;
+    while ((ret = fcntl(ldb->fd, F_SETLKW, &lck)) == -1 && errno == EINTR)
+        ;
+    return ret;
+}
+
+static struct logent *logdb_find(struct logdb *ldb, const char *key, int klen, zulong hash) {
+    struct logent *ent;
+
+    for (ent = ldb->buckets[hash & (ldb->nbuckets - 1)]; ent; ent = ent->next) {
+        if (ent->hash == hash && ent->klen == (unsigned) klen &&
+            !memcmp(ent->key, key, klen))
+            return ent;
+    }
+    return NULL;
+}
+
+static void logdb_rehash(struct logdb *ldb, zulong nbuckets) {
+    struct logent **buckets = (struct logent **) zshcalloc(nbuckets * sizeof(struct logent *));
+    struct logent *ent, *next;
+    zulong i;
+
+    for (i = 0; i < ldb->nbuckets; i++) {
+        for (ent = ldb->buckets[i]; ent; ent = next) {
+            next = ent->next;
+            ent->next = buckets[ent->hash & (nbuckets - 1)];
+            buckets[ent->hash & (nbuckets - 1)] = ent;
+        }
+    }
+    if (ldb->buckets)
+        zfree(ldb->buckets, ldb->nbuckets * sizeof(struct logent *));
+    ldb->buckets = buckets;
+    ldb->nbuckets = nbuckets;
+}
+
+/*
+ * Brings the index in line with record at `off`. Size
+ * of records that it makes dead is added to garbage.
+ */
+
+static void logdb_apply(struct logdb *ldb, const char *key, unsigned int klen,
+                        unsigned int vlen, off_t off) {
+    zulong hash = keyhash(key, klen);
+    struct logent *ent = logdb_find(ldb, key, klen, hash), **entp;
+
+    if (ent)
+        ldb->garbage += sizeof(struct log_rechdr) + klen + ent->vlen;
+
+    if (vlen == LOG_TOMBSTONE) {
+        ldb->garbage += sizeof(struct log_rechdr) + klen;
+        if (ent) {
+            for (entp = &ldb->buckets[hash & (ldb->nbuckets - 1)]; *entp != ent;
+                 entp = &(*entp)->next)
+                ;
+            *entp = ent->next;
+            if (ldb->iterent == ent) {
+                ldb->iterent = ent->next;
+                ldb->iterskip = 1;
+            }
+            zfree(ent, offsetof(struct logent, key) + klen);
+            ldb->count--;
+        }
+        return;
+    }
+
+    if (!ent) {
+        if (ldb->count >= ldb->nbuckets)
+            logdb_rehash(ldb, 2 * ldb->nbuckets);
+        ent = (struct logent *) zalloc(offsetof(struct logent, key) + klen);
+        ent->hash = hash;
+        ent->klen = klen;
+        memcpy(ent->key, key, klen);
+        ent->next = ldb->buckets[hash & (ldb->nbuckets - 1)];
+        ldb->buckets[hash & (ldb->nbuckets - 1)] = ent;
+        ldb->count++;
+    }
+    ent->voff = off + sizeof(struct log_rechdr) + klen;
+    ent->vlen = vlen;
+}
+
+/*
+ * Applies whole records from `off` on, of `data` holding
+ * the file from `base` to `size`. Returns the end of the
+ * last one.
+ */
+
+static off_t logdb_scan(struct logdb *ldb, const char *data, off_t base, off_t off, off_t size) {
+    struct log_rechdr hdr;
+
+    while (off + (off_t) sizeof(hdr) <= size) {
+        off_t reclen;
+
+        memcpy(&hdr, data + (off - base), sizeof(hdr));
+        reclen = sizeof(hdr) + (off_t) hdr.klen +
+            (hdr.vlen == LOG_TOMBSTONE ? 0 : (off_t) hdr.vlen);
+        if (off + reclen > size)
+            break;
+        logdb_apply(ldb, data + (off - base) + sizeof(hdr), hdr.klen, hdr.vlen, off);
+        off += reclen;
+    }
+    return off;
+}
+
+/*
+ * Reads the log into the index. A record cut short by
+ * a crash ends the log, it is truncated for a writer.
+ */
+
+static int logdb_replay(struct logdb *ldb) {
+    struct stat st;
+    char *data;
+    off_t off, size;
+    int mapped = 0;
+
+    if (fstat(ldb->fd, &st))
+        return 1;
+    size = st.st_size;
+
+    if (size == 0) {
+        if (ldb->readonly)
+            return 0;
+        if (write_loop(ldb->fd, LOG_MAGIC, sizeof(LOG_MAGIC) - 1) != sizeof(LOG_MAGIC) - 1)
+            return 1;
+        ldb->end = sizeof(LOG_MAGIC) - 1;
+        return 0;
+    }
+
+#if defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+    data = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, ldb->fd, 0);
+    if (data != (char *) MAP_FAILED)
+        mapped = 1;
+    else
+#endif
+    {
+        data = (char *) zalloc(size);
+        if (pread(ldb->fd, data, size, 0) != size) {
+            zfree(data, size);
+            return 1;
+        }
+    }
+
+    if (size < (off_t) sizeof(LOG_MAGIC) - 1 ||
+        memcmp(data, LOG_MAGIC, sizeof(LOG_MAGIC) - 1)) {
+        errno = EINVAL;
+        off = -1;
+    } else {
+        off = logdb_scan(ldb, data, 0, sizeof(LOG_MAGIC) - 1, size);
+    }
+
+#if defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+    if (mapped)
+        munmap(data, size);
+    else
+#endif
+        zfree(data, size);
+
+    if (off == -1)
+        return 1;
+    ldb->end = off;
+    if (off < size && !ldb->readonly && ftruncate(ldb->fd, off))
+        return 1;
+    return 0;
+}
+
+/*
+ * Reads records appended past `end` by a forked subshell,
+ * or by the shell that tied for the subshell.
+ */
+
+static int logdb_tail(struct logdb *ldb) {
+    struct stat st;
+    off_t len;
+    char *data;
+
+    if (fstat(ldb->fd, &st))
+        return 1;
+    if (st.st_size <= ldb->end)
+        return 0;
+
+    len = st.st_size - ldb->end;
+    data = (char *) zalloc(len);
+    if (pread(ldb->fd, data, len, ldb->end) != len) {
+        zfree(data, len);
+        return 1;
+    }
+    ldb->end = logdb_scan(ldb, data, ldb->end, ldb->end, st.st_size);
+    zfree(data, len);
+
+    if (ldb->garbage >= LOG_COMPACT_MIN && ldb->garbage > ldb->end / 2)
+        ldb->compact = 1;
+    return 0;
+}
+
+static void *logdb_open(char *nam, char *path, int readonly, struct tieopts *opts) {
+    struct logdb *ldb;
+    int fd;
+
+    fd = open(unmeta(path), (readonly ? O_RDONLY : O_RDWR | O_CREAT) | O_NOCTTY, 0666);
+    if (fd == -1 || logdb_lock(fd, readonly)) {
+        if (fd != -1 && opts->retry && (errno == EAGAIN || errno == EACCES))
+            errno = EWOULDBLOCK;
+        else
+            zwarnnam(nam, "error opening database file %s (%e)", path, errno);
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+
+    ldb = (struct logdb *) zshcalloc(sizeof(struct logdb));
+    ldb->fd = fd;
+    ldb->pid = getpid();
+    ldb->path = ztrdup(unmeta(path));
+    ldb->readonly = readonly;
+    ldb->sync = !(opts->set & TOPT_BIT(TOPT_SYNC)) || opts->val[TOPT_SYNC];
+    logdb_rehash(ldb, 64);
+
+    if (logdb_replay(ldb)) {
+        zwarnnam(nam, "error reading database file %s (%e)", path, errno);
+        logdb_close(ldb);
+        return NULL;
+    }
+
+    return ldb;
+}
+
+static void logdb_free_index(struct logdb *ldb) {
+    struct logent *ent, *next;
+    zulong i;
+
+    for (i = 0; i < ldb->nbuckets; i++) {
+        for (ent = ldb->buckets[i]; ent; ent = next) {
+            next = ent->next;
+            zfree(ent, offsetof(struct logent, key) + ent->klen);
+        }
+        ldb->buckets[i] = NULL;
+    }
+    ldb->count = 0;
+    ldb->iterent = NULL;
+    ldb->iterbucket = ldb->nbuckets;
+}
+
+static void logdb_close(void *db) {
+    struct logdb *ldb = (struct logdb *) db;
+
+    if (ldb->compact && ldb->pid == getpid())
+        (void)logdb_compact(ldb);
+
+    logdb_free_index(ldb);
+    zfree(ldb->buckets, ldb->nbuckets * sizeof(struct logent *));
+    if (ldb->buf)
+        zfree(ldb->buf, ldb->bufsize);
+    zsfree(ldb->path);
+    close(ldb->fd);
+    zfree(ldb, sizeof(struct logdb));
+}
+
+static int logdb_fetch(void *db, datum key, datum *content) {
+    struct logdb *ldb = (struct logdb *) db;
+    struct logent *ent = logdb_find(ldb, key.dptr, key.dsize, keyhash(key.dptr, key.dsize));
+
+    if (!ent)
+        return 1;
+
+    if (ldb->bufsize < ent->vlen + 1) {
+        if (ldb->buf)
+            zfree(ldb->buf, ldb->bufsize);
+        ldb->bufsize = ent->vlen + 1;
+        ldb->buf = (char *) zalloc(ldb->bufsize);
+    }
+    if (pread(ldb->fd, ldb->buf, ent->vlen, ent->voff) != (ssize_t) ent->vlen)
+        return 1;
+
+    content->dptr = ldb->buf;
+    content->dsize = ent->vlen;
+    return 0;
+}
+
+/*
+ * Appends a record, then applies it to the index.
+ */
+
+static int logdb_append(struct logdb *ldb, datum key, datum content, int tombstone) {
+    struct log_rechdr hdr;
+    size_t reclen;
+    char *rec;
+    int ret;
+
+    if (ldb->readonly)
+        return -1;
+    if (logdb_applock(ldb, F_WRLCK))
+        return -1;
+
+    /* The file was compacted, this subshell writes to the old one */
+    if (ldb->pid != getpid()) {
+        struct stat st, fst;
+
+        if (stat(ldb->path, &st) || fstat(ldb->fd, &fst) ||
+            st.st_ino != fst.st_ino || st.st_dev != fst.st_dev) {
+            (void)logdb_applock(ldb, F_UNLCK);
+            return -1;
+        }
+    }
+    if (logdb_tail(ldb)) {
+        (void)logdb_applock(ldb, F_UNLCK);
+        return -1;
+    }
+
+    hdr.klen = key.dsize;
+    hdr.vlen = tombstone ? LOG_TOMBSTONE : (unsigned int) content.dsize;
+    reclen = sizeof(hdr) + key.dsize + (tombstone ? 0 : content.dsize);
+
+    rec = (char *) zalloc(reclen);
+    memcpy(rec, &hdr, sizeof(hdr));
+    memcpy(rec + sizeof(hdr), key.dptr, key.dsize);
+    if (!tombstone)
+        memcpy(rec + sizeof(hdr) + key.dsize, content.dptr, content.dsize);
+    ret = pwrite(ldb->fd, rec, reclen, ldb->end) == (ssize_t) reclen ? 0 : -1;
+    zfree(rec, reclen);
+    (void)logdb_applock(ldb, F_UNLCK);
+
+    if (ret)
+        return -1;
+    if (ldb->sync)
+        (void)fsync(ldb->fd);
+
+    logdb_apply(ldb, key.dptr, hdr.klen, hdr.vlen, ldb->end);
+    ldb->end += reclen;
+
+    if (ldb->garbage >= LOG_COMPACT_MIN && ldb->garbage > ldb->end / 2)
+        ldb->compact = 1;
+    return 0;
+}
+
+static int logdb_store(void *db, datum key, datum content, int replace) {
+    struct logdb *ldb = (struct logdb *) db;
+
+    /* Others' records are read again under the lock */
+    if (!replace && !logdb_tail(ldb) &&
+        logdb_find(ldb, key.dptr, key.dsize, keyhash(key.dptr, key.dsize)))
+        return 1;
+    return logdb_append(ldb, key, content, 0);
+}
+
+static int logdb_delete(void *db, datum key) {
+    struct logdb *ldb = (struct logdb *) db;
+
+    (void)logdb_tail(ldb);
+    if (!logdb_find(ldb, key.dptr, key.dsize, keyhash(key.dptr, key.dsize)))
+        return 1;
+    return logdb_append(ldb, key, key, 1) ? -1 : 0;
+}
+
+static int logdb_nextkey(void *db, datum *key) {
+    struct logdb *ldb = (struct logdb *) db;
+
+    if (ldb->iterskip) {
+        ldb->iterskip = 0;
+    } else {
+        /* Continuing after a key not from the iteration */
+        if (!ldb->iterent || key->dptr != ldb->iterent->key) {
+            zulong hash = keyhash(key->dptr, key->dsize);
+
+            if (!(ldb->iterent = logdb_find(ldb, key->dptr, key->dsize, hash)))
+                return 1;
+            ldb->iterbucket = hash & (ldb->nbuckets - 1);
+        }
+        ldb->iterent = ldb->iterent->next;
+    }
+    while (!ldb->iterent && ++ldb->iterbucket < ldb->nbuckets)
+        ldb->iterent = ldb->buckets[ldb->iterbucket];
+    if (!ldb->iterent)
+        return 1;
+
+    key->dptr = ldb->iterent->key;
+    key->dsize = ldb->iterent->klen;
+    return 0;
+}
+
+static int logdb_firstkey(void *db, datum *key) {
+    struct logdb *ldb = (struct logdb *) db;
+
+    ldb->iterbucket = 0;
+    ldb->iterent = ldb->buckets[0];
+    ldb->iterskip = 0;
+    if (ldb->iterent) {
+        key->dptr = ldb->iterent->key;
+        key->dsize = ldb->iterent->klen;
+        return 0;
+    }
+    ldb->iterskip = 1;
+    return logdb_nextkey(db, key);
+}
+
+static zulong logdb_count(void *db) {
+    return ((struct logdb *) db)->count;
+}
+
+static int logdb_sync(void *db) {
+    return fsync(((struct logdb *) db)->fd);
+}
+
+static int logdb_fd(void *db) {
+    return ((struct logdb *) db)->fd;
+}
+
+static int logdb_wipe(void *db) {
+    struct logdb *ldb = (struct logdb *) db;
+
+    /* The index of the shell that tied would be wrong */
+    if (ldb->readonly || ldb->pid != getpid())
+        return -1;
+
+    logdb_free_index(ldb);
+    ldb->end = sizeof(LOG_MAGIC) - 1;
+    ldb->garbage = 0;
+    ldb->compact = 0;
+    return ftruncate(ldb->fd, ldb->end);
+}
+
+static int logdb_info(void *db, char **info, int n) {
+    struct logdb *ldb = (struct logdb *) db;
+
+    ADDNUMINFO("keys", ldb->count);
+    ADDNUMINFO("garbage", ldb->garbage);
+    ADDNUMINFO("sync", ldb->sync);
+    return n;
+}
+
+static void logdb_idle(void *db) {
+    struct logdb *ldb = (struct logdb *) db;
+
+    if (ldb->compact && ldb->pid == getpid())
+        (void)logdb_compact(ldb);
+}
+
+/* Subshells appended, as the change log tells */
+
+static void logdb_reload(void *db) {
+    (void)logdb_tail((struct logdb *) db);
+}
+
+/*
+ * Writes live records to a new file, locked before it is
+ * renamed over the log. Offsets in the index are updated
+ * only once the new file is in place.
+ */
+
+static int logdb_compact(struct logdb *ldb) {
+    struct log_rechdr hdr;
+    struct logent *ent;
+    char *tmppath, *buf = NULL;
+    size_t bufsize = 0;
+    off_t off = sizeof(LOG_MAGIC) - 1;
+    zulong i;
+    int fd, err;
+
+    ldb->compact = 0;
+    if (ldb->readonly)
+        return 1;
+
+    /* Subshells don't append meanwhile */
+    if (logdb_applock(ldb, F_WRLCK))
+        return 1;
+    if (logdb_tail(ldb)) {
+        (void)logdb_applock(ldb, F_UNLCK);
+        return 1;
+    }
+
+    tmppath = bicat(ldb->path, ".tmp");
+    fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC | O_NOCTTY, 0666);
+    if (fd == -1) {
+        (void)logdb_applock(ldb, F_UNLCK);
+        zsfree(tmppath);
+        return 1;
+    }
+
+    err = logdb_lock(fd, 0) ||
+        write_loop(fd, LOG_MAGIC, sizeof(LOG_MAGIC) - 1) != sizeof(LOG_MAGIC) - 1;
+    for (i = 0; i < ldb->nbuckets && !err; i++) {
+        for (ent = ldb->buckets[i]; ent && !err; ent = ent->next) {
+            size_t reclen = sizeof(hdr) + ent->klen + ent->vlen;
+
+            if (bufsize < reclen) {
+                if (buf)
+                    zfree(buf, bufsize);
+                buf = (char *) zalloc(bufsize = reclen);
+            }
+            hdr.klen = ent->klen;
+            hdr.vlen = ent->vlen;
+            memcpy(buf, &hdr, sizeof(hdr));
+            memcpy(buf + sizeof(hdr), ent->key, ent->klen);
+            err = pread(ldb->fd, buf + sizeof(hdr) + ent->klen, ent->vlen, ent->voff) !=
+                (ssize_t) ent->vlen ||
+                write_loop(fd, buf, reclen) != (ssize_t) reclen;
+            off += reclen;
+        }
+    }
+    if (buf)
+        zfree(buf, bufsize);
+
+    if (err || fsync(fd) || rename(tmppath, ldb->path)) {
+        close(fd);
+        unlink(tmppath);
+        zsfree(tmppath);
+        (void)logdb_applock(ldb, F_UNLCK);
+        return 1;
+    }
+    zsfree(tmppath);
+    (void)logdb_applock(ldb, F_UNLCK);
+
+    /* Same order as written */
+    ldb->end = sizeof(LOG_MAGIC) - 1;
+    for (i = 0; i < ldb->nbuckets; i++) {
+        for (ent = ldb->buckets[i]; ent; ent = ent->next) {
+            ent->voff = ldb->end + sizeof(hdr) + ent->klen;
+            ldb->end += sizeof(hdr) + ent->klen + ent->vlen;
+        }
+    }
+    ldb->garbage = 0;
+
+    /* New descriptor takes over the old one's place */
+    if (fdtable[ldb->fd] == FDT_MODULE) {
+        fdtable[ldb->fd] = FDT_UNUSED;
+        addmodulefd(fd, FDT_MODULE);
+    }
+    close(ldb->fd);
+    ldb->fd = fd;
+    return 0;
+}
+
+/*
+ * The cdb engine. The header and all tables are checked
+ * at open, offsets of records are checked when used.
+ */
+
+static void *cdbdb_open(char *nam, char *path, int readonly, UNUSED(struct tieopts *opts)) {
+#if defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+    struct cdbdb *cdb;
+    struct cdb_header *hdr;
+    struct stat st;
+    char *map;
+    int fd, i;
+
+    if (!readonly) {
+        zwarnnam(nam, "db/cdb can be only tied read-only (-r), it is written by zgdbmcdb", NULL);
+        return NULL;
+    }
+
+    if ((fd = open(unmeta(path), O_RDONLY | O_NOCTTY)) == -1 || fstat(fd, &st)) {
+        zwarnnam(nam, "error opening database file %s (%e)", path, errno);
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    if (st.st_size < (off_t) sizeof(struct cdb_header) ||
+        (map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == (char *) MAP_FAILED) {
+        zwarnnam(nam, "not a cdb database file %s", path);
+        close(fd);
+        return NULL;
+    }
+
+    hdr = (struct cdb_header *) map;
+    for (i = 0; i < CDB_NTABLES; i++) {
+        struct cdb_table *tbl = &hdr->tables[i];
+
+        if (tbl->nslots & (tbl->nslots - 1) ||
+            (tbl->nslots && (tbl->off < sizeof(struct cdb_header) ||
+                             tbl->off % sizeof(zulong) ||
+                             tbl->off > (zulong) st.st_size ||
+                             tbl->nslots > ((zulong) st.st_size - tbl->off) /
+                             sizeof(struct snap_slot))))
+            break;
+    }
+    if (memcmp(hdr->magic, CDB_MAGIC, sizeof(hdr->magic)) || i < CDB_NTABLES) {
+        zwarnnam(nam, "not a cdb database file %s", path);
+        munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    cdb = (struct cdbdb *) zshcalloc(sizeof(struct cdbdb));
+    cdb->fd = fd;
+    cdb->map = map;
+    cdb->size = st.st_size;
+    return cdb;
+#else
+    zwarnnam(nam, "db/cdb needs mmap(), not available", NULL);
+    return NULL;
+#endif
+}
+
+static void cdbdb_close(void *db) {
+    struct cdbdb *cdb = (struct cdbdb *) db;
+
+#if defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+    munmap(cdb->map, cdb->size);
+#endif
+    close(cdb->fd);
+    zfree(cdb, sizeof(struct cdbdb));
+}
+
+/* Key and value of record at `off`, 1 if it is outside of the file */
+
+static int cdbdb_record(struct cdbdb *cdb, zulong off, datum *key, datum *content) {
+    struct log_rechdr rec;
+
+    if (off < sizeof(struct cdb_header) || off > cdb->size - sizeof(rec))
+        return 1;
+    memcpy(&rec, cdb->map + off, sizeof(rec));
+    off += sizeof(rec);
+    if ((zulong) rec.klen + rec.vlen > cdb->size - off)
+        return 1;
+
+    key->dptr = cdb->map + off;
+    key->dsize = rec.klen;
+    content->dptr = cdb->map + off + rec.klen;
+    content->dsize = rec.vlen;
+    return 0;
+}
+
+static int cdbdb_fetch(void *db, datum key, datum *content) {
+    struct cdbdb *cdb = (struct cdbdb *) db;
+    zulong h = keyhash(key.dptr, key.dsize), mask, j, n;
+    struct cdb_table *tbl = &((struct cdb_header *) cdb->map)->tables[h & (CDB_NTABLES - 1)];
+    struct snap_slot *slots = (struct snap_slot *) (cdb->map + tbl->off);
+    datum rkey;
+
+    mask = tbl->nslots - 1;
+    for (j = (h >> 8) & mask, n = tbl->nslots; n && slots[j].off; j = (j + 1) & mask, n--) {
+        if (slots[j].hash == h && !cdbdb_record(cdb, slots[j].off, &rkey, content) &&
+            rkey.dsize == key.dsize && !memcmp(rkey.dptr, key.dptr, key.dsize))
+            return 0;
+    }
+    return 1;
+}
+
+static int cdbdb_store(UNUSED(void *db), UNUSED(datum key), UNUSED(datum content), UNUSED(int replace)) {
+    return -1;
+}
+
+static int cdbdb_delete(UNUSED(void *db), UNUSED(datum key)) {
+    return -1;
+}
+
+static int cdbdb_nextkey(void *db, datum *key) {
+    struct cdbdb *cdb = (struct cdbdb *) db;
+    struct cdb_header *hdr = (struct cdb_header *) cdb->map;
+    struct snap_slot *slot;
+    datum content;
+
+    for (; cdb->itertable < CDB_NTABLES; cdb->itertable++, cdb->iterslot = 0) {
+        struct cdb_table *tbl = &hdr->tables[cdb->itertable];
+
+        while (cdb->iterslot < tbl->nslots) {
+            slot = (struct snap_slot *) (cdb->map + tbl->off) + cdb->iterslot++;
+            if (slot->off && !cdbdb_record(cdb, slot->off, key, &content))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int cdbdb_firstkey(void *db, datum *key) {
+    struct cdbdb *cdb = (struct cdbdb *) db;
+
+    cdb->itertable = cdb->iterslot = 0;
+    return cdbdb_nextkey(db, key);
+}
+
+static zulong cdbdb_count(void *db) {
+    return ((struct cdb_header *) ((struct cdbdb *) db)->map)->nkeys;
+}
+
+static int cdbdb_sync(UNUSED(void *db)) {
+    return 0;
+}
+
+static int cdbdb_fd(void *db) {
+    return ((struct cdbdb *) db)->fd;
+}
+
+static int cdbdb_wipe(UNUSED(void *db)) {
+    return -1;
+}
+
+static int cdbdb_info(void *db, char **info, int n) {
+    ADDNUMINFO("keys", cdbdb_count(db));
+    return n;
+}
+
+/*
+ * Writing of a cdb file by zgdbmcdb. Records are written
+ * to a temporary file as they come, only their hashes and
+ * offsets are kept. cdbmake_finish() adds the tables and
+ * renames the file into place. If a key repeats, its last
+ * value is used.
+ */
+
+static int cdbmake_start(struct cdbmake *mk, const char *path) {
+    struct cdb_header hdr;
+    int saved_errno;
+
+    memset(mk, 0, sizeof(struct cdbmake));
+    mk->tmppath = bicat(path, ".tmp");
+    if (!(mk->out = fopen(mk->tmppath, "w+"))) {
+        saved_errno = errno;
+        zsfree(mk->tmppath);
+        errno = saved_errno;
+        return 1;
+    }
+
+    /* Written again at the end */
+    memset(&hdr, 0, sizeof(hdr));
+    if (fwrite(&hdr, sizeof(hdr), 1, mk->out) != 1)
+        mk->err = errno;
+    mk->off = sizeof(hdr);
+    return 0;
+}
+
+static void cdbmake_add(struct cdbmake *mk, const char *key, unsigned int klen,
+                        const char *val, unsigned int vlen) {
+    struct log_rechdr rec;
+
+    if (mk->err)
+        return;
+
+    if (mk->nrecs == mk->recsize) {
+        struct snap_slot *newrecs = (struct snap_slot *)
+            zalloc((mk->recsize ? 2 * mk->recsize : 1024) * sizeof(struct snap_slot));
+        if (mk->recs) {
+            memcpy(newrecs, mk->recs, mk->recsize * sizeof(struct snap_slot));
+            zfree(mk->recs, mk->recsize * sizeof(struct snap_slot));
+        }
+        mk->recs = newrecs;
+        mk->recsize = mk->recsize ? 2 * mk->recsize : 1024;
+    }
+    mk->recs[mk->nrecs].hash = keyhash(key, klen);
+    mk->recs[mk->nrecs++].off = mk->off;
+
+    rec.klen = klen;
+    rec.vlen = vlen;
+    if (fwrite(&rec, sizeof(rec), 1, mk->out) != 1 ||
+        (klen && fwrite(key, klen, 1, mk->out) != 1) ||
+        (vlen && fwrite(val, vlen, 1, mk->out) != 1))
+        mk->err = errno ? errno : EIO;
+    mk->off += sizeof(rec) + klen + vlen;
+}
+
+/*
+ * Reads a null-terminated string (or one ended by end of
+ * file) into `*buf`, growing it. Returns its length, -1 at
+ * end of file.
+ */
+
+static int cdbmake_field(FILE *in, char **buf, size_t *size) {
+    size_t len = 0;
+    int c;
+
+    while ((c = getc(in)) != EOF && c) {
+        if (len == *size) {
+            char *newbuf = (char *) zalloc(2 * *size);
+            memcpy(newbuf, *buf, *size);
+            zfree(*buf, *size);
+            *buf = newbuf;
+            *size *= 2;
+        }
+        (*buf)[len++] = c;
+    }
+    return (c == EOF && !len) ? -1 : (int) len;
+}
+
+/* Whether records at two offsets of the written file have the same key */
+
+static int cdbmake_samekey(struct cdbmake *mk, zulong off1, zulong off2) {
+    struct log_rechdr rec1, rec2;
+    char *key1, *key2;
+    int fd = fileno(mk->out), same;
+
+    if (pread(fd, &rec1, sizeof(rec1), off1) != sizeof(rec1) ||
+        pread(fd, &rec2, sizeof(rec2), off2) != sizeof(rec2)) {
+        mk->err = errno ? errno : EIO;
+        return 0;
+    }
+    if (rec1.klen != rec2.klen)
+        return 0;
+
+    key1 = (char *) zalloc(rec1.klen + 1);
+    key2 = (char *) zalloc(rec1.klen + 1);
+    if (pread(fd, key1, rec1.klen, off1 + sizeof(rec1)) != (ssize_t) rec1.klen ||
+        pread(fd, key2, rec1.klen, off2 + sizeof(rec2)) != (ssize_t) rec1.klen) {
+        mk->err = errno ? errno : EIO;
+        same = 0;
+    } else {
+        same = !memcmp(key1, key2, rec1.klen);
+    }
+    zfree(key1, rec1.klen + 1);
+    zfree(key2, rec1.klen + 1);
+    return same;
+}
+
+static int cdbmake_finish(struct cdbmake *mk, const char *path) {
+    struct cdb_header hdr;
+    struct snap_slot *slots = NULL;
+    zulong counts[CDB_NTABLES], base[CDB_NTABLES], total = 0, nkeys = 0, i, j, mask;
+    int t, saved_errno;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(counts, 0, sizeof(counts));
+    if (!mk->err && fflush(mk->out))
+        mk->err = errno;
+
+    /* Sizes of tables, they follow the records, aligned */
+    for (i = 0; i < mk->nrecs; i++)
+        counts[mk->recs[i].hash & (CDB_NTABLES - 1)]++;
+    while (!mk->err && mk->off % sizeof(zulong)) {
+        if (putc('\0', mk->out) == EOF)
+            mk->err = errno;
+        mk->off++;
+    }
+    for (t = 0; t < CDB_NTABLES; t++) {
+        if (counts[t])
+            for (hdr.tables[t].nslots = 2; hdr.tables[t].nslots < 2 * counts[t];
+                 hdr.tables[t].nslots <<= 1)
+                ;
+        hdr.tables[t].off = hdr.tables[t].nslots ?
+            mk->off + total * sizeof(struct snap_slot) : 0;
+        base[t] = total;
+        total += hdr.tables[t].nslots;
+    }
+
+    /* Records in order, so a repeated key gets the last value */
+    if (total)
+        slots = (struct snap_slot *) zshcalloc(total * sizeof(struct snap_slot));
+    for (i = 0; i < mk->nrecs && !mk->err; i++) {
+        zulong h = mk->recs[i].hash;
+
+        t = h & (CDB_NTABLES - 1);
+        mask = hdr.tables[t].nslots - 1;
+        for (j = (h >> 8) & mask; slots[base[t] + j].off; j = (j + 1) & mask) {
+            if (slots[base[t] + j].hash == h &&
+                cdbmake_samekey(mk, slots[base[t] + j].off, mk->recs[i].off))
+                break;
+        }
+        if (!slots[base[t] + j].off)
+            nkeys++;
+        slots[base[t] + j] = mk->recs[i];
+    }
+
+    memcpy(hdr.magic, CDB_MAGIC, sizeof(hdr.magic));
+    hdr.nkeys = nkeys;
+    if (!mk->err && ((total && fwrite(slots, sizeof(struct snap_slot), total, mk->out) != total) ||
+                     fseek(mk->out, 0L, SEEK_SET) ||
+                     fwrite(&hdr, sizeof(hdr), 1, mk->out) != 1))
+        mk->err = errno ? errno : EIO;
+    if (fclose(mk->out) && !mk->err)
+        mk->err = errno;
+
+    if (slots)
+        zfree(slots, total * sizeof(struct snap_slot));
+    if (mk->recs)
+        zfree(mk->recs, mk->recsize * sizeof(struct snap_slot));
+
+    if (mk->err || rename(mk->tmppath, path)) {
+        saved_errno = mk->err ? mk->err : errno;
+        unlink(mk->tmppath);
+        zsfree(mk->tmppath);
+        errno = saved_errno;
+        return 1;
+    }
+    zsfree(mk->tmppath);
+    return 0;
+}
+
+#ifdef ZGDBM_WRITEBEHIND
+
+/*
+ * The write-behind queue. Takes over `db` of `inner`,
+ * NULL if the thread can't be started.
+ */
+
+static void *wb_start(char *nam, const struct zgdbm_backend *inner, void *db, zlong size) {
+    struct wbdb *wb;
+    sigset_t all, old;
+    int err;
+
+    wb = (struct wbdb *) zshcalloc(sizeof(struct wbdb));
+    wb->inner = inner;
+    wb->db = db;
+    wb->pid = getpid();
+    wb->size = size > WB_MAXSIZE ? WB_MAXSIZE : size;
+    wb->queue = (struct wbentry *) zshcalloc(wb->size * sizeof(struct wbentry));
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_mutex_init(&wb->dblock, NULL);
+    pthread_cond_init(&wb->work, NULL);
+    pthread_cond_init(&wb->done, NULL);
+
+    /* Signals are for the shell */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&wb->thread, NULL, wb_thread, wb);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!err && !wb_forkset) {
+        if ((err = pthread_atfork(wb_prefork, wb_postfork, wb_postfork))) {
+            pthread_mutex_lock(&wb->lock);
+            wb->stop = 1;
+            pthread_cond_signal(&wb->work);
+            pthread_mutex_unlock(&wb->lock);
+            pthread_join(wb->thread, NULL);
+        } else {
+            wb_forkset = 1;
+        }
+    }
+    if (err) {
+        zwarnnam(nam, "cannot start write-behind thread (%e)", err);
+        pthread_mutex_destroy(&wb->lock);
+        pthread_mutex_destroy(&wb->dblock);
+        pthread_cond_destroy(&wb->work);
+        pthread_cond_destroy(&wb->done);
+        zfree(wb->queue, wb->size * sizeof(struct wbentry));
+        zfree(wb, sizeof(struct wbdb));
+        return NULL;
+    }
+    wb->next = wb_list;
+    wb_list = wb;
+    return wb;
+}
+
+/* Before fork(), the queues are drained and engines locked */
+
+static void wb_prefork(void) {
+    struct wbdb *wb;
+    pid_t pid = getpid();
+
+    for (wb = wb_list; wb; wb = wb->next) {
+        if (wb->pid != pid)
+            continue;
+        pthread_mutex_lock(&wb->lock);
+        while (wb->tail != wb->head)
+            pthread_cond_wait(&wb->done, &wb->lock);
+        pthread_mutex_lock(&wb->dblock);
+        wb->forking = 1;
+    }
+}
+
+/* After fork(), in the parent and in the child */
+
+static void wb_postfork(void) {
+    struct wbdb *wb;
+
+    for (wb = wb_list; wb; wb = wb->next) {
+        if (!wb->forking)
+            continue;
+        wb->forking = 0;
+        pthread_mutex_unlock(&wb->dblock);
+        pthread_mutex_unlock(&wb->lock);
+    }
+}
+
+static void *wb_thread(void *arg) {
+    struct wbdb *wb = (struct wbdb *) arg;
+    struct wbentry *ent;
+    int ret;
+
+    pthread_mutex_lock(&wb->lock);
+    for (;;) {
+        while (wb->tail == wb->head && !wb->stop)
+            pthread_cond_wait(&wb->work, &wb->lock);
+        if (wb->tail == wb->head)
+            break;
+        ent = &wb->queue[wb->tail % wb->size];
+        pthread_mutex_unlock(&wb->lock);
+
+        pthread_mutex_lock(&wb->dblock);
+        if (ent->content.dptr)
+            ret = wb->inner->store(wb->db, ent->key, ent->content, 1) != 0;
+        else
+            ret = wb->inner->delete(wb->db, ent->key) < 0;
+        pthread_mutex_unlock(&wb->dblock);
+
+        pthread_mutex_lock(&wb->lock);
+        wb->failed += ret;
+        wb->tail++;
+        pthread_cond_broadcast(&wb->done);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+/* Frees entries the thread is done with */
+
+static void wb_reclaim(struct wbdb *wb) {
+    struct wbentry *ent;
+    zulong tail;
+
+    pthread_mutex_lock(&wb->lock);
+    tail = wb->tail;
+    pthread_mutex_unlock(&wb->lock);
+
+    for (; wb->freed != tail; wb->freed++) {
+        ent = &wb->queue[wb->freed % wb->size];
+        zfree(ent->key.dptr, ent->key.dsize + 1);
+        if (ent->content.dptr)
+            zfree(ent->content.dptr, ent->content.dsize + 1);
+    }
+}
+
+static void wb_flush(struct wbdb *wb) {
+    if (wb->pid != getpid())
+        return;
+
+    pthread_mutex_lock(&wb->lock);
+    while (wb->tail != wb->head)
+        pthread_cond_wait(&wb->done, &wb->lock);
+    pthread_mutex_unlock(&wb->lock);
+    wb_reclaim(wb);
+}
+
+static void wb_close(void *db) {
+    struct wbdb *wb = (struct wbdb *) db;
+    struct wbdb **wbp;
+
+    for (wbp = &wb_list; *wbp; wbp = &(*wbp)->next) {
+        if (*wbp == wb) {
+            *wbp = wb->next;
+            break;
+        }
+    }
+
+    /* The thread stops when the queue is drained */
+    if (wb->pid == getpid()) {
+        pthread_mutex_lock(&wb->lock);
+        wb->stop = 1;
+        pthread_cond_signal(&wb->work);
+        pthread_mutex_unlock(&wb->lock);
+        pthread_join(wb->thread, NULL);
+        pthread_mutex_destroy(&wb->lock);
+        pthread_mutex_destroy(&wb->dblock);
+        pthread_cond_destroy(&wb->work);
+        pthread_cond_destroy(&wb->done);
+    }
+    for (; wb->freed != wb->head; wb->freed++) {
+        struct wbentry *ent = &wb->queue[wb->freed % wb->size];
+        zfree(ent->key.dptr, ent->key.dsize + 1);
+        if (ent->content.dptr)
+            zfree(ent->content.dptr, ent->content.dsize + 1);
+    }
+
+    wb->inner->close(wb->db);
+    zfree(wb->queue, wb->size * sizeof(struct wbentry));
+    zfree(wb, sizeof(struct wbdb));
+}
+
+/* Newest value of key still in the queue */
+
+static int wb_fetch(void *db, datum key, datum *content) {
+    struct wbdb *wb = (struct wbdb *) db;
+    struct wbentry *ent;
+    zulong i;
+    int ret;
+
+    /* In a child, the queue was drained at fork */
+    if (wb->pid != getpid())
+        return wb->inner->fetch(wb->db, key, content);
+
+    for (i = wb->head; i != wb->freed; i--) {
+        ent = &wb->queue[(i - 1) % wb->size];
+        if (ent->key.dsize == key.dsize && !memcmp(ent->key.dptr, key.dptr, key.dsize)) {
+            if (!ent->content.dptr)
+                return 1;
+            *content = ent->content;
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&wb->dblock);
+    ret = wb->inner->fetch(wb->db, key, content);
+    pthread_mutex_unlock(&wb->dblock);
+    return ret;
+}
+
+static int wb_queue(struct wbdb *wb, datum key, datum content) {
+    struct wbentry ent;
+
+    ent.key.dptr = (char *) zalloc(key.dsize + 1);
+    memcpy(ent.key.dptr, key.dptr, key.dsize);
+    ent.key.dsize = key.dsize;
+    ent.content.dsize = content.dsize;
+    if (content.dptr) {
+        ent.content.dptr = (char *) zalloc(content.dsize + 1);
+        memcpy(ent.content.dptr, content.dptr, content.dsize);
+    } else {
+        ent.content.dptr = NULL;
+    }
+
+    /* Entries are reused only after they're freed */
+    for (wb_reclaim(wb); wb->head - wb->freed == wb->size; wb_reclaim(wb)) {
+        pthread_mutex_lock(&wb->lock);
+        while (wb->head - wb->tail == wb->size)
+            pthread_cond_wait(&wb->done, &wb->lock);
+        pthread_mutex_unlock(&wb->lock);
+    }
+
+    pthread_mutex_lock(&wb->lock);
+    wb->queue[wb->head % wb->size] = ent;
+    wb->head++;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->lock);
+    return 0;
+}
+
+static int wb_store(void *db, datum key, datum content, int replace) {
+    struct wbdb *wb = (struct wbdb *) db;
+
+    /* The parent's thread writes, a child doesn't */
+    if (wb->pid != getpid())
+        return -1;
+    if (!replace) {
+        datum old;
+        if (!wb_fetch(db, key, &old))
+            return 1;
+    }
+    return wb_queue(wb, key, content);
+}
+
+static int wb_delete(void *db, datum key) {
+    struct wbdb *wb = (struct wbdb *) db;
+    datum none;
+
+    if (wb->pid != getpid())
+        return -1;
+    none.dptr = NULL;
+    none.dsize = 0;
+    return wb_queue(wb, key, none);
+}
+
+static int wb_firstkey(void *db, datum *key) {
+    struct wbdb *wb = (struct wbdb *) db;
+
+    wb_flush(wb);
+    return wb->inner->firstkey(wb->db, key);
+}
+
+static int wb_nextkey(void *db, datum *key) {
+    struct wbdb *wb = (struct wbdb *) db;
+
+    wb_flush(wb);
+    return wb->inner->nextkey(wb->db, key);
+}
+
+static zulong wb_count(void *db) {
+    struct wbdb *wb = (struct wbdb *) db;
+
+    wb_flush(wb);
+    return wb->inner->count(wb->db);
+}
+
+static int wb_sync(void *db) {
+    struct wbdb *wb = (struct wbdb *) db;
+
+    wb_flush(wb);
+    return wb->inner->sync(wb->db);
+}
+
+static int wb_fd(void *db) {
+    struct wbdb *wb = (struct wbdb *) db;
+
+    return wb->inner->fd(wb->db);
+}
+
+static int wb_wipe(void *db) {
+    struct wbdb *wb = (struct wbdb *) db;
+
+    if (wb->pid != getpid())
+        return -1;
+    wb_flush(wb);
+    return wb->inner->wipe(wb->db);
+}
+
+static int wb_info(void *db, char **info, int n) {
+    struct wbdb *wb = (struct wbdb *) db;
+
+    ADDNUMINFO("writebehind", wb->size);
+    pthread_mutex_lock(&wb->lock);
+    ADDNUMINFO("queued", wb->head - wb->tail);
+    ADDNUMINFO("failed", wb->failed);
+    pthread_mutex_unlock(&wb->lock);
+
+    wb_flush(wb);
+    return wb->inner->info(wb->db, info, n);
+}
+
+#endif /* ZGDBM_WRITEBEHIND */
+
+/*
+ * Hash of a database key (unmetafied), FNV-1a with
+ * a final mix, so that all bits are usable.
+ */
+
+static zulong keyhash(const char *key, int len) {
+    zulong h = (zulong) 0xcbf29ce484222325ULL;
+
+    while (len-- > 0) {
+        h ^= (unsigned char) *key++;
+        h *= (zulong) 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= (zulong) 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * Tracing of operations, see zgdbmtrace.
+ */
+
+static zlong trace_now(void) {
+    struct timeval tv;
+    struct timezone dummy_tz;
+
+    gettimeofday(&tv, &dummy_tz);
+    return (zlong) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void trace_add(int op, zlong start, zulong hash, zulong size) {
+    struct trace_ent *ent;
+
+    /* Tracing stopped during the operation */
+    if (!trace_ring)
+        return;
+    ent = &trace_ring[trace_count++ % trace_size];
+    ent->start = start;
+    ent->dur = trace_now() - start;
+    ent->hash = hash;
+    ent->size = size;
+    ent->op = op;
+}
+
+/* Adds operation on a metafied key or path */
+
+static void trace_name(int op, zlong start, const char *name, zulong size) {
+    char *umname = dupstring(name);
+    int len;
+
+    unmetafy(umname, &len);
+    trace_add(op, start, keyhash(umname, len), size);
+}
+
+static void trace_stop(void) {
+    if (trace_ring) {
+        zfree(trace_ring, trace_size * sizeof(struct trace_ent));
+        trace_ring = NULL;
+    }
+    trace_size = trace_count = 0;
+}
+
+/*
+ * Returns 0 if the key is for sure not in the database.
+ * Without a filter every key can be there.
+ */
+
+static int bloom_test(struct gsu_scalar_ext *gsu_ext, const char *key, int len) {
+    struct zgdbm_bloom *bloom = gsu_ext->bloom;
+    zulong h1, h2, mask;
+    int i;
+
+    if (!bloom)
+        return 1;
+
+    h1 = keyhash(key, len);
+    h2 = (h1 >> 32) | 1;
+    mask = bloom->nbits - 1;
+    for (i = 0; i < BLOOM_HASHES; i++, h1 += h2) {
+        if (!(bloom->bits[(h1 & mask) >> 3] & (1 << (h1 & 7))))
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Adds stored key to the filter. When the filter fills
+ * up it is rebuilt with the double of keys it has now.
+ */
+
+static void bloom_add(struct gsu_scalar_ext *gsu_ext, const char *key, int len) {
+    struct zgdbm_bloom *bloom = gsu_ext->bloom;
+    zulong h1, h2, mask;
+    int i;
+
+    if (!bloom)
+        return;
+
+    if (++bloom->nkeys * BLOOM_BITS_PER_KEY > bloom->nbits) {
+        if (bloom_build(gsu_ext))
+            bloom_free(gsu_ext);
+        return;
+    }
+
+    h1 = keyhash(key, len);
+    h2 = (h1 >> 32) | 1;
+    mask = bloom->nbits - 1;
+    for (i = 0; i < BLOOM_HASHES; i++, h1 += h2)
+        bloom->bits[(h1 & mask) >> 3] |= 1 << (h1 & 7);
+
+    bloom->dirty = 1;
+}
+
+/*
+ * (Re)creates the filter from keys of the database,
+ * sized for twice the number of keys. The key hashes
+ * are gathered first, so the database is scanned once.
+ */
+
+static int bloom_build(struct gsu_scalar_ext *gsu_ext) {
+    struct zgdbm_bloom *bloom;
+    zulong *hashes = NULL, nhashes = 0, hsize = 0, nbits, i;
+    datum key;
+    int ret;
+
+    if (!gsu_ext->db)
+        return 1;
+
+    ret = gsu_ext->backend->firstkey(gsu_ext->db, &key);
+    while (!ret) {
+        if (nhashes == hsize) {
+            zulong *newhashes = (zulong *) zalloc((hsize ? 2 * hsize : 1024) * sizeof(zulong));
+            if (hashes) {
+                memcpy(newhashes, hashes, hsize * sizeof(zulong));
+                zfree(hashes, hsize * sizeof(zulong));
+            }
+            hashes = newhashes;
+            hsize = hsize ? 2 * hsize : 1024;
+        }
+        hashes[nhashes++] = keyhash(key.dptr, key.dsize);
+
+        ret = gsu_ext->backend->nextkey(gsu_ext->db, &key);
+    }
+
+    for (nbits = BLOOM_MIN_BITS; nbits < 2 * nhashes * BLOOM_BITS_PER_KEY; nbits <<= 1)
+        ;
+
+    bloom_free(gsu_ext);
+    bloom = gsu_ext->bloom = (struct zgdbm_bloom *) zalloc(sizeof(struct zgdbm_bloom));
+    bloom->nbits = nbits;
+    bloom->nkeys = nhashes;
+    bloom->dirty = 1;
+    bloom->bits = (unsigned char *) zshcalloc(nbits / 8);
+
+    for (i = 0; i < nhashes; i++) {
+        zulong h1 = hashes[i], h2 = (h1 >> 32) | 1;
+        int j;
+
+        for (j = 0; j < BLOOM_HASHES; j++, h1 += h2)
+            bloom->bits[(h1 & (nbits - 1)) >> 3] |= 1 << (h1 & 7);
+    }
+
+    if (hashes)
+        zfree(hashes, hsize * sizeof(zulong));
+    return 0;
+}
+
+/*
+ * Path of the sidecar file, unmetafied, on heap.
+ */
+
+static char *bloom_path(struct gsu_scalar_ext *gsu_ext) {
+    return dupstring(unmeta(dyncat(gsu_ext->dbfile_path, ".bloom")));
+}
+
+/*
+ * Loads the filter from the sidecar file. Fails if there
+ * is no such file or it was written for different size
+ * or modification time of the database.
+ */
+
+static int bloom_load(struct gsu_scalar_ext *gsu_ext) {
+    struct bloom_header hdr;
+    struct stat st;
+    struct zgdbm_bloom *bloom;
+    int fd;
+
+    if (gsu_ext->backend->fd(gsu_ext->db) == -1 ||
+        fstat(gsu_ext->backend->fd(gsu_ext->db), &st))
+        return 1;
+    if ((fd = open(bloom_path(gsu_ext), O_RDONLY | O_NOCTTY)) == -1)
+        return 1;
+
+    if (read_loop(fd, (char *) &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, BLOOM_MAGIC, sizeof(hdr.magic)) ||
+        hdr.dbsize != (zulong) st.st_size ||
+        hdr.dbmtime != (zulong) st.st_mtime ||
+#ifdef GET_ST_MTIME_NSEC
+        hdr.dbmtime_ns != (zulong) GET_ST_MTIME_NSEC(st) ||
+#endif
+        hdr.nbits < BLOOM_MIN_BITS || (hdr.nbits & (hdr.nbits - 1))) {
+        close(fd);
+        return 1;
+    }
+
+    bloom = (struct zgdbm_bloom *) zalloc(sizeof(struct zgdbm_bloom));
+    bloom->nbits = hdr.nbits;
+    bloom->nkeys = hdr.nkeys;
+    bloom->dirty = 0;
+    bloom->bits = (unsigned char *) zalloc(hdr.nbits / 8);
+
+    if (read_loop(fd, (char *) bloom->bits, hdr.nbits / 8) != (ssize_t) (hdr.nbits / 8)) {
+        zfree(bloom->bits, hdr.nbits / 8);
+        zfree(bloom, sizeof(struct zgdbm_bloom));
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    bloom_free(gsu_ext);
+    gsu_ext->bloom = bloom;
+    return 0;
+}
+
+/*
+ * Writes the filter to the sidecar file, stamped with
+ * current size and modification time of the database.
+ * A temporary file is renamed over the old one.
+ */
+
+static int bloom_save(struct gsu_scalar_ext *gsu_ext) {
+    struct zgdbm_bloom *bloom = gsu_ext->bloom;
+    struct bloom_header hdr;
+    struct stat st;
+    char *path, *tmppath;
+    int fd, err;
+
+    if (!bloom || !gsu_ext->db)
+        return 1;
+
+    /* Stamp what is on the disk */
+    gsu_ext->backend->sync(gsu_ext->db);
+    if (gsu_ext->backend->fd(gsu_ext->db) == -1 ||
+        fstat(gsu_ext->backend->fd(gsu_ext->db), &st))
+        return 1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BLOOM_MAGIC, sizeof(hdr.magic));
+    hdr.nbits = bloom->nbits;
+    hdr.nkeys = bloom->nkeys;
+    hdr.dbsize = st.st_size;
+    hdr.dbmtime = st.st_mtime;
+#ifdef GET_ST_MTIME_NSEC
+    hdr.dbmtime_ns = GET_ST_MTIME_NSEC(st);
+#endif
+
+    path = bloom_path(gsu_ext);
+    tmppath = bicat(path, ".tmp");
+    if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, 0666)) == -1) {
+        zsfree(tmppath);
+        return 1;
+    }
+
+    err = write_loop(fd, (char *) &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        write_loop(fd, (char *) bloom->bits, bloom->nbits / 8) != (ssize_t) (bloom->nbits / 8);
+    err = close(fd) || err;
+    if (err || rename(tmppath, path)) {
+        unlink(tmppath);
+        zsfree(tmppath);
+        return 1;
+    }
+    zsfree(tmppath);
+
+    bloom->dirty = 0;
+    return 0;
 }
 
-/**/
-static void
-gdbmunsetfn(Param pm, UNUSED(int um))
-{
-    /* Set with NULL */
-    gdbmsetfn(pm, NULL);
+static void bloom_free(struct gsu_scalar_ext *gsu_ext) {
+    struct zgdbm_bloom *bloom = gsu_ext->bloom;
+
+    if (bloom) {
+        zfree(bloom->bits, bloom->nbits / 8);
+        zfree(bloom, sizeof(struct zgdbm_bloom));
+        gsu_ext->bloom = NULL;
+    }
 }
 
-/**/
-static HashNode
-getgdbmnode(HashTable ht, const char *name)
-{
-    HashNode hn = gethashnode2( ht, name );
-    Param val_pm = (Param) hn;
+/*
+ * Counts use of a key (metafied). Conservative update:
+ * only counters at the minimum grow, so estimates of
+ * rare keys stay low.
+ */
 
-    /* Entry for key doesn't exist? Create it now,
-     * it will be interfacing between the database
-     * and Zsh - through special gdbm_gsu. So, any
-     * seen key results in new interfacing parameter.
-     *
-     * Previous code was returning heap arena Param
-     * that wasn't actually added to the hash. It was
-     * plainly name / database-key holder. Here we
-     * add the Param to its hash, it is not PM_UPTODATE.
-     * It will be loaded from database *and filled*
-     * or left in that state if the database doesn't
-     * contain it.
-     *
-     * No heap arena memory is used, memory usage is
-     * now limited - by number of distinct keys seen,
-     * not by number of key *uses*.
-     * */
+static void warm_note(struct zgdbm_warm *warm, const char *name) {
+    zulong h = keyhash(name, strlen(name));
+    unsigned short *c[WARM_ROWS], min = WARM_MAXCOUNT;
+    int r;
 
-    if ( ! val_pm ) {
-        val_pm = (Param) zshcalloc( sizeof (*val_pm) );
-        val_pm->node.flags = PM_SCALAR | PM_HASHELEM; /* no PM_UPTODATE */
-        val_pm->gsu.s = (GsuScalar) ht->tmpdata;
-        ht->addnode( ht, ztrdup( name ), val_pm ); // sets pm->node.nam
+    for (r = 0; r < WARM_ROWS; r++) {
+        c[r] = &warm->counts[r][(h >> (16 * r)) & (WARM_WIDTH - 1)];
+        if (*c[r] < min)
+            min = *c[r];
+    }
+    if (min == WARM_MAXCOUNT)
+        return;
+    for (r = 0; r < WARM_ROWS; r++) {
+        if (*c[r] == min)
+            (*c[r])++;
     }
-
-    return (HashNode) val_pm;
 }
 
-/**/
-static void
-scangdbmkeys(HashTable ht, ScanFunc func, int flags)
-{
-    datum key;
-    GDBM_FILE dbf = ((struct gsu_scalar_ext *)ht->tmpdata)->dbf;
-
-    /* Iterate keys adding them to hash, so
-     * we have Param to use in `func` */
-    key = gdbm_firstkey(dbf);
+static unsigned short warm_count(struct zgdbm_warm *warm, const char *name) {
+    zulong h = keyhash(name, strlen(name));
+    unsigned short min = WARM_MAXCOUNT, c;
+    int r;
 
-    while(key.dptr) {
-        /* This returns database-interfacing Param,
-         * it will return u.str or first fetch data
-         * if not PM_UPTODATE (newly created) */
-        char *zkey = metafy(key.dptr, key.dsize, META_DUP);
-        HashNode hn = getgdbmnode(ht, zkey);
-        zsfree( zkey );
+    for (r = 0; r < WARM_ROWS; r++) {
+        c = warm->counts[r][(h >> (16 * r)) & (WARM_WIDTH - 1)];
+        if (c < min)
+            min = c;
+    }
+    return min;
+}
 
-	func(hn, flags);
+/*
+ * Fetches values of keys listed in the sidecar file into
+ * the hash. They are counted as used once, so keys used
+ * in every session stay listed.
+ */
 
-        /* Iterate - no problem as interfacing Param
-         * will do at most only fetches, not stores */
-        key = gdbm_nextkey(dbf, key);
+static void warm_load(struct gsu_scalar_ext *gsu_ext) {
+    struct zgdbm_warm *warm = gsu_ext->warm;
+    struct stat st;
+    char *path, *buf, *p, *end;
+    int fd;
+
+    path = unmeta(dyncat(gsu_ext->dbfile_path, ".warm"));
+    if ((fd = open(path, O_RDONLY | O_NOCTTY)) == -1)
+        return;
+    if (fstat(fd, &st) || st.st_size <= (off_t) strlen(WARM_MAGIC)) {
+        close(fd);
+        return;
     }
+    buf = (char *) zhalloc(st.st_size + 1);
+    if (read_loop(fd, buf, st.st_size) != (ssize_t) st.st_size ||
+        memcmp(buf, WARM_MAGIC, strlen(WARM_MAGIC))) {
+        close(fd);
+        return;
+    }
+    close(fd);
+    buf[st.st_size] = '\0';
+
+    end = buf + st.st_size;
+    for (p = buf + strlen(WARM_MAGIC);
+         p < end && warm->loaded < gsu_ext->opts->val[TOPT_WARM]; p += strlen(p) + 1) {
+        (void)getgdbmvalue((Param) getgdbmnode(gsu_ext->ht, p));
+        warm_note(warm, p);
+        warm->loaded++;
+    }
+}
+
+struct warm_key {
+    char *name;
+    unsigned short count;
+};
 
+static int warm_cmp(const void *a, const void *b) {
+    return (int) ((const struct warm_key *) b)->count -
+        (int) ((const struct warm_key *) a)->count;
 }
 
 /*
- * Replace database with new hash
+ * Writes the keys of the hash used most, metafied and
+ * null-terminated, to the sidecar file.
  */
 
-/**/
-static void
-gdbmhashsetfn(Param pm, HashTable ht)
-{
-    int i;
+static void warm_save(struct gsu_scalar_ext *gsu_ext) {
+    HashTable ht = gsu_ext->ht;
+    struct warm_key *keys;
     HashNode hn;
-    GDBM_FILE dbf;
-    datum key, content;
+    char *path, *tmppath;
+    zlong i, n = 0;
+    FILE *out;
+    int err;
+
+    keys = (struct warm_key *) zhalloc((ht->ct + 1) * sizeof(struct warm_key));
+    for (i = 0; i < ht->hsize; i++) {
+        for (hn = ht->nodes[i]; hn; hn = hn->next) {
+            if ((keys[n].count = warm_count(gsu_ext->warm, hn->nam)))
+                keys[n++].name = hn->nam;
+        }
+    }
+    qsort(keys, n, sizeof(struct warm_key), warm_cmp);
+    if (n > gsu_ext->opts->val[TOPT_WARM])
+        n = gsu_ext->opts->val[TOPT_WARM];
+
+    path = dupstring(unmeta(dyncat(gsu_ext->dbfile_path, ".warm")));
+    tmppath = dyncat(path, ".tmp");
+    if (!(out = fopen(tmppath, "w")))
+        return;
+    err = fwrite(WARM_MAGIC, strlen(WARM_MAGIC), 1, out) != 1;
+    for (i = 0; i < n && !err; i++)
+        err = fwrite(keys[i].name, strlen(keys[i].name) + 1, 1, out) != 1;
+    err = fclose(out) || err;
+    if (err || rename(tmppath, path))
+        unlink(tmppath);
+}
 
-    if (!pm->u.hash || pm->u.hash == ht)
-	return;
+/*
+ * Before each prompt, backends of all ties can do
+ * work that was put off until the shell is idle.
+ */
 
-    if (!(dbf = ((struct gsu_scalar_ext *)pm->u.hash->tmpdata)->dbf))
-	return;
+static void zgdbm_preprompt(void) {
+    char **name;
+    Param pm;
 
-    key = gdbm_firstkey(dbf);
-    while (key.dptr) {
-	queue_signals();
-	(void)gdbm_delete(dbf, key);
-	free(key.dptr);
-	unqueue_signals();
-	key = gdbm_firstkey(dbf);
+    for (name = zgdbm_tied; *name; name++) {
+        struct gsu_scalar_ext *gsu_ext;
+
+        pm = (Param) paramtab->getnode(paramtab, *name);
+        if (!pm || !(gsu_ext = tied_ext(pm)))
+            continue;
+        if (gsu_ext->watch && watch_changed(gsu_ext))
+            tie_refresh(pm->u.hash);
+        if (gsu_ext->snap && gsu_ext->snap->old) {
+            snap_close(gsu_ext->snap->old);
+            gsu_ext->snap->old = NULL;
+        }
+        if (gsu_ext->db && gsu_ext->backend->idle)
+            gsu_ext->backend->idle(gsu_ext->db);
+        if (gsu_ext->sweep && gsu_ext->db && !(pm->node.flags & PM_READONLY))
+            tie_sweep(gsu_ext);
     }
 
-    /* just deleted everything, clean up */
-    (void)gdbm_reorganize(dbf);
+    tie_idleclose(1);
+}
 
-    if (!ht)
-	return;
+/*
+ * Closes lazy ties unused for their idle time, at the
+ * prompt also those with idle=0. For the rest a timed
+ * function is scheduled, zle calls it while waiting
+ * for input.
+ */
 
-     /* Put new strings into database, waiting
-      * for their interfacing-Params to be created */
+static void tie_idleclose(int prompt) {
+    time_t now = time(NULL), next = 0, due;
+    char **name;
+    Param pm;
 
-    for (i = 0; i < ht->hsize; i++)
-	for (hn = ht->nodes[i]; hn; hn = hn->next) {
-	    struct value v;
+    for (name = zgdbm_tied; *name; name++) {
+        struct gsu_scalar_ext *gsu_ext;
 
-	    v.isarr = v.flags = v.start = 0;
-	    v.end = -1;
-	    v.arr = NULL;
-	    v.pm = (Param) hn;
+        pm = (Param) paramtab->getnode(paramtab, *name);
+        if (!pm || !(gsu_ext = tied_ext(pm)))
+            continue;
+        if (!gsu_ext->lazy || !gsu_ext->db)
+            continue;
 
-            /* Unmetafy key */
-            int umlen = 0;
-            char *umkey = unmetafy_zalloc(v.pm->node.nam,&umlen);
+        due = gsu_ext->lazy->used + gsu_ext->opts->val[TOPT_IDLE];
+        if ((prompt && !gsu_ext->opts->val[TOPT_IDLE]) || due <= now)
+            tie_close(gsu_ext);
+        else if (!next || due < next)
+            next = due;
+    }
 
-	    key.dptr = umkey;
-	    key.dsize = umlen;
+    if (next != idle_when) {
+        if (idle_when)
+            deltimedfn(zgdbm_idletimer);
+        if ((idle_when = next))
+            addtimedfn(zgdbm_idletimer, next);
+    }
+}
 
-	    queue_signals();
+static void zgdbm_idletimer(void) {
+    deltimedfn(zgdbm_idletimer);
+    idle_when = 0;
+    tie_idleclose(0);
+}
 
-            /* Unmetafy */
-            char *umval = unmetafy_zalloc(getstrvalue(&v),&umlen);
+/*
+ * Watch of the database file (ztie -w). Its identity,
+ * size and modification time are compared before each
+ * prompt and before a scan of the keys - inotify isn't
+ * used, it doesn't see writes GDBM makes through its
+ * map. Cached values are then forgotten all at once, so
+ * a lookup costs the same as without the watch.
+ */
 
-            /* Store */
-	    content.dptr = umval;
-	    content.dsize = umlen;
-	    (void)gdbm_store(dbf, key, content, GDBM_REPLACE);	
+static int watch_start(struct gsu_scalar_ext *gsu_ext, const char *path, int reopen) {
+    struct zgdbm_watch *watch;
 
-            /* Free - unmetafy_zalloc allocates exact required
-             * space, however unmetafied string can have zeros
-             * in content, so we must first fill with non-0 bytes */
-            set_length(umval, content.dsize);
-            zsfree(umval);
-            set_length(umkey, key.dsize);
-            zsfree(umkey);
+    watch = (struct zgdbm_watch *) zalloc(sizeof(struct zgdbm_watch));
+    watch->path = ztrdup(unmeta(path));
+    watch->reopen = reopen;
+    if (stat(watch->path, &watch->st)) {
+        int saved_errno = errno;
 
-	    unqueue_signals();
-	}
+        zsfree(watch->path);
+        zfree(watch, sizeof(struct zgdbm_watch));
+        errno = saved_errno;
+        return 1;
+    }
+    gsu_ext->watch = watch;
+    return 0;
 }
 
-/**/
-static void
-gdbmuntie(Param pm)
-{
-    GDBM_FILE dbf = ((struct gsu_scalar_ext *)pm->u.hash->tmpdata)->dbf;
-    HashTable ht = pm->u.hash;
+/* Whether the watched file changed since last call */
 
-    if (dbf) { /* paranoia */
-	fdtable[gdbm_fdesc(dbf)] = FDT_UNUSED;
-        gdbm_close(dbf);
+static int watch_changed(struct gsu_scalar_ext *gsu_ext) {
+    struct stat st;
 
-        /* Let hash fields know there's no backend */
-        ((struct gsu_scalar_ext *)ht->tmpdata)->dbf = NULL;
+    if (stat(gsu_ext->watch->path, &st) ||
+        !st_changed(&st, &gsu_ext->watch->st))
+        return 0;
+    gsu_ext->watch->st = st;
+    return 1;
+}
 
-        /* Remove from list of tied parameters */
-        remove_tied_name(pm->node.nam);
-    }
+/*
+ * After a write of this shell: its cached values are
+ * current, the file isn't seen as changed by others.
+ */
 
-    /* for completeness ... createspecialhash() should have an inverse */
-    ht->getnode = ht->getnode2 = gethashnode2;
-    ht->scantab = NULL;
+static void watch_mark(struct gsu_scalar_ext *gsu_ext) {
+    struct stat st;
 
-    pm->node.flags &= ~(PM_SPECIAL|PM_READONLY);
-    pm->gsu.h = &stdhash_gsu;
+    if (!stat(gsu_ext->watch->path, &st))
+        gsu_ext->watch->st = st;
 }
 
-/**/
-static void
-gdbmhashunsetfn(Param pm, UNUSED(int exp))
-{
-    gdbmuntie(pm);
+static void watch_stop(struct gsu_scalar_ext *gsu_ext) {
+    if (!gsu_ext->watch)
+        return;
+    zsfree(gsu_ext->watch->path);
+    zfree(gsu_ext->watch, sizeof(struct zgdbm_watch));
+    gsu_ext->watch = NULL;
+}
 
-    /* Remember custom GSU structure assigned to
-     * u.hash->tmpdata before hash gets deleted */
-    struct gsu_scalar_ext * gsu_ext = pm->u.hash->tmpdata;
+/* Whether a file is another one, or was written */
 
-    /* Uses normal unsetter. Will delete all owned
-     * parameters and also hashtable. */
-    pm->gsu.h->setfn(pm, NULL);
+static int st_changed(const struct stat *st, const struct stat *old) {
+    return st->st_ino != old->st_ino || st->st_dev != old->st_dev ||
+        st->st_size != old->st_size || st->st_mtime != old->st_mtime
+#ifdef GET_ST_MTIME_NSEC
+        || GET_ST_MTIME_NSEC(*st) != GET_ST_MTIME_NSEC(*old)
+#endif
+        ;
+}
 
-    /* Don't need custom GSU structure with its
-     * GDBM_FILE pointer anymore */
-    zsfree( gsu_ext->dbfile_path );
-    zfree( gsu_ext, sizeof(struct gsu_scalar_ext));
+/*
+ * Brings a watched tie up to date: read-only ties open
+ * the file again (it may be a new one), then all cached
+ * values are forgotten.
+ */
 
-    pm->node.flags |= PM_UNSET;
+static void tie_refresh(HashTable ht) {
+    struct gsu_scalar_ext *gsu_ext = (struct gsu_scalar_ext *) ht->tmpdata;
+
+    if (gsu_ext->watch->reopen) {
+        if (gsu_ext->snap) {
+            struct zgdbm_snap *snap =
+                snap_open(unmeta(dyncat(gsu_ext->dbfile_path, ".snap")));
+            /* Values of the old one can still be in use */
+            if (snap) {
+                snap->old = gsu_ext->snap;
+                gsu_ext->snap = snap;
+            }
+        } else if (gsu_ext->db) {
+            void *db = gsu_ext->backend->open("ztie", gsu_ext->dbfile_path, 1,
+                                              gsu_ext->opts);
+            if (db) {
+                int fd = gsu_ext->backend->fd(gsu_ext->db);
+
+                if (fd != -1)
+                    fdtable[fd] = FDT_UNUSED;
+                gsu_ext->backend->close(gsu_ext->db);
+                gsu_ext->db = db;
+                if ((fd = gsu_ext->backend->fd(db)) != -1)
+                    addmodulefd(fd, FDT_MODULE);
+
+                /* Keys may be gone, the filter is built anew */
+                if (gsu_ext->bloom) {
+                    bloom_free(gsu_ext);
+                    if (bloom_load(gsu_ext))
+                        (void)bloom_build(gsu_ext);
+                }
+            }
+        }
+    }
+
+    tie_forget(ht);
 }
 
-static struct features module_features = {
-    bintab, sizeof(bintab)/sizeof(*bintab),
-    NULL, 0,
-    NULL, 0,
-    patab, sizeof(patab)/sizeof(*patab),
-    0
-};
+/*
+ * Change log shared with forked subshells. It's a
+ * temporary file, unlinked at once and mapped, so it
+ * is inherited with the mapping by every fork. A
+ * subshell writing to the tie appends the key, and the
+ * shell that tied drops its cached value at its next
+ * access to the hash. Appends and consuming are done
+ * under fcntl() lock of the file.
+ */
 
-/**/
-int
-setup_(UNUSED(Module m))
-{
-    return 0;
-}
+static int chlog_open(struct gsu_scalar_ext *gsu_ext) {
+#if defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+    struct zgdbm_chlog *chlog;
+    char *name;
+    void *map;
+    int fd, saved_errno;
 
-/**/
-int
-features_(Module m, char ***features)
-{
-    *features = featuresarray(m, &module_features);
+    if ((fd = gettempfile(NULL, 0, &name)) == -1)
+        return 1;
+    unlink(name);
+    zsfree(name);
+
+    if (ftruncate(fd, CHLOG_SIZE) ||
+        (map = mmap(NULL, CHLOG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return 1;
+    }
+    addmodulefd(fd, FDT_MODULE);
+
+    chlog = (struct zgdbm_chlog *) zalloc(sizeof(struct zgdbm_chlog));
+    chlog->fd = fd;
+    chlog->pid = getpid();
+    chlog->seen = 0;
+    chlog->hdr = (struct chlog_header *) map;
+    gsu_ext->chlog = chlog;
     return 0;
+#else
+    errno = ENOSYS;
+    return 1;
+#endif
 }
 
-/**/
-int
-enables_(Module m, int **enables)
-{
-    return handlefeatures(m, &module_features, enables);
+static void chlog_close(struct gsu_scalar_ext *gsu_ext) {
+    if (!gsu_ext->chlog)
+        return;
+#if defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+    munmap((void *) gsu_ext->chlog->hdr, CHLOG_SIZE);
+#endif
+    zclose(gsu_ext->chlog->fd);
+    zfree(gsu_ext->chlog, sizeof(struct zgdbm_chlog));
+    gsu_ext->chlog = NULL;
 }
 
-/**/
-int
-boot_(UNUSED(Module m))
-{
-    zgdbm_tied = zshcalloc((1) * sizeof(char *));
-    return 0;
-}
+static int chlog_lock(struct zgdbm_chlog *chlog, int type) {
+    struct flock lck;
+    int ret;
 
-/**/
-int
-cleanup_(Module m)
-{
-    /* This frees `zgdbm_tied` */
-    return setfeatureenables(m, &module_features, NULL);
+    memset(&lck, 0, sizeof(lck));
+    lck.l_type = type;
+    lck.l_whence = SEEK_SET;
+    while ((ret = fcntl(chlog->fd, F_SETLKW, &lck)) == -1 && errno == EINTR)
+        ;
+    return ret;
 }
 
-/**/
-int
-finish_(UNUSED(Module m))
-{
-    return 0;
+/*
+ * In a subshell, records change of the key (metafied),
+ * or with NULL of all keys.
+ */
+
+static void chlog_note(struct gsu_scalar_ext *gsu_ext, const char *name) {
+    struct zgdbm_chlog *chlog = gsu_ext->chlog;
+    struct chlog_header *hdr;
+    size_t len;
+
+    /* Own writes aren't changes for the watch */
+    if (gsu_ext->watch)
+        watch_mark(gsu_ext);
+    if (!chlog || chlog->pid == getpid() || chlog_lock(chlog, F_WRLCK))
+        return;
+
+    hdr = chlog->hdr;
+    len = name ? strlen(name) + 1 : 0;
+    if (!name || sizeof(struct chlog_header) + hdr->used + len > CHLOG_SIZE) {
+        hdr->all = 1;
+    } else {
+        memcpy((char *) hdr + sizeof(struct chlog_header) + hdr->used, name, len);
+        hdr->used += len;
+    }
+    hdr->seq++;
+
+    (void)chlog_lock(chlog, F_UNLCK);
 }
 
-/*********************
- * Utility functions *
- *********************/
+/*
+ * In the shell that tied, drops cached values of keys
+ * changed by subshells. Callers check `seq` first.
+ */
 
-static Param createhash( char *name, int flags ) {
-    Param pm;
-    HashTable ht;
+static void chlog_apply(HashTable ht) {
+    struct gsu_scalar_ext *gsu_ext = (struct gsu_scalar_ext *) ht->tmpdata;
+    struct zgdbm_chlog *chlog = gsu_ext->chlog;
+    struct chlog_header *hdr = chlog->hdr;
+    HashNode hn;
+    char *name, *end;
 
-    pm = createparam(name, flags | PM_SPECIAL | PM_HASHED);
-    if (!pm) {
-        return NULL;
-    }
+    if (chlog->pid != getpid() || chlog_lock(chlog, F_WRLCK))
+        return;
 
-    if (pm->old)
-	pm->level = locallevel;
+    /* The engine may have to read what the subshells wrote */
+    if (gsu_ext->db && gsu_ext->backend->reload)
+        gsu_ext->backend->reload(gsu_ext->db);
 
-    /* This creates standard hash. */
-    ht = pm->u.hash = newparamtable(32, name);
-    if (!pm->u.hash) {
-        paramtab->removenode(paramtab, name);
-        paramtab->freenode(&pm->node);
-        zwarnnam(name, "Out of memory when allocating hash");
+    /* Keys added by subshells go into the filter too */
+    if (hdr->all) {
+        tie_forget(ht);
+        if (gsu_ext->bloom && bloom_build(gsu_ext))
+            bloom_free(gsu_ext);
+    } else {
+        name = (char *) hdr + sizeof(struct chlog_header);
+        for (end = name + hdr->used; name < end; name += strlen(name) + 1) {
+            if ((hn = gethashnode2(ht, name))) {
+                ((Param) hn)->node.flags &= ~PM_UPTODATE;
+            }
+            if (gsu_ext->bloom) {
+                char *umkey = dupstring(name);
+                int umlen;
+
+                unmetafy(umkey, &umlen);
+                bloom_add(gsu_ext, umkey, umlen);
+            }
+        }
     }
+    hdr->used = 0;
+    hdr->all = 0;
+    chlog->seen = hdr->seq;
 
-    /* These provide special features */
-    ht->getnode = ht->getnode2 = getgdbmnode;
-    ht->scantab = scangdbmkeys;
+    (void)chlog_lock(chlog, F_UNLCK);
+}
 
-    return pm;
+/*
+ * Stores still queued for write-behind ties are done
+ * before the shell exits.
+ */
+
+static int zgdbm_exithook(UNUSED(Hookdef d), UNUSED(void *dummy)) {
+#ifdef ZGDBM_WRITEBEHIND
+    char **name;
+    Param pm;
+
+    for (name = zgdbm_tied; *name; name++) {
+        struct gsu_scalar_ext *gsu_ext;
+
+        pm = (Param) paramtab->getnode(paramtab, *name);
+        if (!pm || !(gsu_ext = tied_ext(pm)))
+            continue;
+        if (gsu_ext->db && gsu_ext->backend == &wb_backend)
+            wb_flush((struct wbdb *) gsu_ext->db);
+    }
+#endif
+    return 0;
 }
 
 /*